@@ -230,6 +230,7 @@
 //#define TFT_BL   22  // LED back-light
 
 #define TOUCH_CS 26     // Chip select pin (T_CS) of touch screen
+//#define TOUCH_IRQ 32    // Interrupt pin (T_IRQ) of touch screen, the sketch polls the touch screen without it
 
 //#define TFT_WR 22    // Write strobe for modified Raspberry Pi TFT only
 
@@ -27,3 +27,32 @@
 #define SOFT_AP_PW    ""                       //!< Soft access point password
 #define WIFI_SID      "sid"                    //!< WiFi SID
 #define WIFI_PW       "password"               //!< WiFi password
+#define WEB_SERVER    true                     //!< WiFi and web interface, the setup waits up to 30 s for the station
+#define STEP_I2S      false                    //!< I2S dma step output instead of the timer, a missed refill pauses the motors
+#define DEBUG_SENSOR  false                    //!< Prints every sensor edge, slows the loop during a job
+#define DEBUG_DISPLAY false                    //!< Prints the time of a full screen redraw at the start
+
+// Axis tables: steps/mm (Q16.16), direction inverted, { start rate, max rate, acceleration, jerk } in steps
+// The rates have to be tuned to the stepper and the supply voltage
+#define AXIS_X_CONFIG { FIX16(10000.0 / 260), false, { 6000, 24000, 80000, 2000000 } }  //!< Feed roller in
+#define AXIS_Y_CONFIG { FIX16(10000.0 / 260), false, { 4000, 16000, 60000, 2000000 } }  //!< Cutter
+#define AXIS_Z_CONFIG { FIX16(10000.0 / 260), false, { 6000, 24000, 80000, 2000000 } }  //!< Feed roller out
+
+// Wire path, measured from the cutter blade to where the sensor switches
+#define CUTTER_TO_OUT_SENSOR FIX16(35.0)       //!< mm from the blade to the out sensor
+#define FEED_TOLERANCE       FIX16(0.02)       //!< Feed deviation counted as slip
+#define FEED_AUTO_CORRECT    false             //!< Track the steps/mm with the measured feed
+#define FEED_CORRECT_SHIFT   2                 //!< A measurement moves the steps/mm 1/4 of the way
+#define FEED_MAX_CORRECTION  FIX16(0.10)       //!< Bigger deviations are a jam, not a calibration error
+
+// Cutter and batch jobs
+#define CUTTER_STROKE        4000              //!< Cutter steps from fully open to closed, until a position is learned
+#define CUTTER_CLEARANCE     FIX16(0.5)        //!< mm the blade opens beyond the wire diameter
+#define CUTTER_LEARN_STEP    20                //!< Resolution of the learned closing position in steps
+#define CUTTER_LEARN_MARGIN  40                //!< Steps the blade closes beyond the learned position
+#define CUTTER_LEARN_FEED    FIX16(10.0)       //!< mm a test piece reaches beyond the out sensor
+#define STRIP_STROKE         3000              //!< Cutter steps that cut the insulation only
+#define EJECT_LENGTH         FIX16(100.0)      //!< mm the out roller ejects a cut piece
+#define PREFEED_LENGTH       FIX16(20.0)       //!< mm the in roller feeds during the eject, has to stay short of the out roller
+#define JOB_LENGTH           FIX16(100.0)      //!< Piece length of the start button
+#define JOB_QUANTITY         10                //!< Pieces of the start button
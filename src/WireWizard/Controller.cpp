@@ -21,49 +21,190 @@
   */
 
 #include "Controller.h"  
+#include "Config.h"
 
 
+/** A job cut off by a reset is restored paused, START resumes it. */
 void Controller::begin()
 {
+  uint32_t made = 0;
+
+  if (!jobLog.begin()) {
+    return;
+  }
+  cutter.begin();
+  cutList.begin();
+  if (jobLog.load(job, cutList, made)) {
+    cutter.park();
+    if (job.start(true, made, true)) {
+      start(CONTROLLER_JOB, 0);
+    }
+  }
 }
 
-void Controller::move(double mm)
+/** The job measures the feed with the sensor edges. */
+void Controller::handleEvent(const SensorEvent &event)
 {
-  motors.beep(100);
-  
-  motors.stepX(-mm * STEPS_PER_MM);
-  motors.stepZ(-mm * STEPS_PER_MM);
+  job.handleEvent(event);
+}
 
-  while (!motors.isIdle()) {
-    delay(10);
+/** Takes over the moves just queued as the running operation. */
+bool Controller::start(ControllerState s, uint32_t seq)
+{
+  state   = s;
+  waitSeq = seq;
+  return true;
+}
+
+/** The running operation is done. */
+void Controller::finish()
+{
+  switch (state) {
+  case CONTROLLER_LEARN: 
+    cutDone = learnTry == learnHigh;
+    if (learnCut) {
+      cutter.learn(learnHigh + CUTTER_LEARN_MARGIN);
+    }
+    Serial.println((String) "Cutter: " + (learnCut ? "closes at " + String(cutter.getClose()) : "no test cut went through") + 
+                   ", opens to " + cutter.getOpen() + " steps");
+    break;
+  case CONTROLLER_JOB:   
+    if (motors.isEnabled()) {
+      cutter.home();
+    }
+    if (job.isJammed()) {
+      Serial.println("Job stopped: the wire did not reach the blade sensor");
+    }
+    cutDone = job.getMade() == job.getTotal(); 
+    if (cutDone) {
+      jobLog.end();
+    } else {
+      jobLog.progress(job, true);              // Switched off, may be resumed after a reset
+    }
+    break;
+  default: break;
   }
+  state = CONTROLLER_IDLE;
   motors.beep(100);
 }
 
-void Controller::eject(double mm)
+/** Queues one test cut at learnTry: feed a piece beyond the out sensor, close the blade 
+  * to learnTry, open it fully and eject until the out sensor is free. Only a piece that 
+  * was cut through leaves the sensor, otherwise the wire holds it and the out roller slips.
+  */
+bool Controller::tryCut()
 {
-  motors.beep(100);
-  
-  motors.stepZ(-mm * STEPS_PER_MM);
+  SensorStop outFree = { SENSOR_CHANNEL_Z, false };
+  fix16_t    mm      = CUTTER_TO_OUT_SENSOR + CUTTER_LEARN_FEED;
+
+  motors.move(-motors.toSteps(AXIS_X, mm), 0, -motors.toSteps(AXIS_Z, mm));
+  motors.move(0, learnTry - cutter.getEndPos(), 0);
+  motors.move(0, -learnTry, 0);
+  return start(CONTROLLER_LEARN, motors.moveUntil(0, 0, -motors.toSteps(AXIS_Z, mm + CUTTER_LEARN_FEED), outFree));
+}
 
-  while (!motors.isIdle()) {
-    delay(10);
+/** Learns where the blade cuts through the wire in use by a bisection of test cuts
+  * between fully open and CUTTER_STROKE. Needs the wire diameter.
+  */
+bool Controller::learn()
+{
+  if (isBusy() || cutter.getWire() <= 0) {
+    return false;
   }
   motors.beep(100);
+
+  learnLow  = 0;
+  learnHigh = CUTTER_STROKE;
+  learnTry  = learnHigh / 2;
+  learnCut  = false;
+  return tryCut();
 }
 
-void Controller::cut()
+/** The wire in use, the next job opens the blade for it. */
+void Controller::setWire(fix16_t diameter)
 {
-  motors.beep(100);
+  if (!isBusy()) {
+    cutter.setWire(diameter);
+  }
+}
 
-  motors.stepY(4000);
-  while (!motors.isIdle()) {
-    delay(10);
+/** Starts the batch job, it trims the wire first if there was no cut before. */
+bool Controller::startJob()
+{
+  if (isBusy()) {
+    return false;
   }
-  motors.stepY(-4000);
-  while (!motors.isIdle()) {
-    delay(10);
+  cutter.park();
+  job.getRecipe().load();                      // The stored recipe, else the default
+  if (!job.start(!cutDone)) {
+    return false;
   }
+  cutDone = false;
+  jobLog.start(job);
   motors.beep(100);
+  return start(CONTROLLER_JOB, 0);
 }
 
+/** A paused job finishes the pieces already queued and waits. */
+void Controller::pause(bool on)
+{
+  if (state == CONTROLLER_JOB) {
+    job.pause(on);
+    jobLog.progress(job, true);
+  }
+}
+
+/** Stops at once and drops everything queued. Where the wire end is afterwards is unknown. */
+void Controller::cancel()
+{
+  if (!isBusy()) {
+    return;
+  }
+  if (state == CONTROLLER_JOB) {
+    job.stop();
+    jobLog.end();
+  } else {
+    motors.resetSteps();
+  }
+  cutDone = false;
+  state   = CONTROLLER_IDLE;
+}
+
+/** Called by the loop task after it handed over the sensor events. 
+  * Returns true when an operation has just ended.
+  */
+bool Controller::tick()
+{
+  SensorTrip trip;
+
+  switch (state) {
+  case CONTROLLER_IDLE:
+    cutter.sync();                             // After the jogs and the home() of a job
+    return false;
+  case CONTROLLER_JOB:
+    job.tick();
+    jobLog.progress(job);
+    if (job.isRunning()) {
+      return false;
+    }
+    break;
+  case CONTROLLER_LEARN:
+    if (!motors.isDone(waitSeq)) {
+      return false;
+    }
+    if (motors.getTrip(waitSeq, trip)) {
+      learnHigh = learnTry;
+      learnCut  = true;
+    } else {
+      learnLow  = learnTry;
+    }
+    if (learnHigh - learnLow > CUTTER_LEARN_STEP) {
+      learnTry = (learnLow + learnHigh) / 2;
+      tryCut();
+      return false;
+    }
+    break;
+  }
+  finish();
+  return true;
+}
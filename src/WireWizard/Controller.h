@@ -19,32 +19,85 @@
 #include <Arduino.h>
 #include "Sensors.h"
 #include "Motors.h"
+#include "FeedMeter.h"
+#include "CutJob.h"
+#include "JobLog.h"
+#include "Profiler.h"
+#include "Cutter.h"
 
 /**
   * @file Controller.h
   * 
-  * Implementation of the cutter controller class
+  * Implementation of the cutter controller class.
+  * The controller is a state machine driven by tick() from the loop task.
+  * An operation only queues its moves and returns, it ends as soon as the 
+  * motor task reports its last segment done, so the loop task keeps serving
+  * the events, the sensor values and a cancel in the meantime.
   */
 
-#define STEPS_PER_MM ((double) 10000 / 260)
-
+enum ControllerState {
+  CONTROLLER_IDLE, CONTROLLER_JOB, CONTROLLER_LEARN
+};
 
 class Controller
 {
 private:
-  Motors  &motors;
-  Sensors &sensors;
+  Motors         &motors;
+  Sensors        &sensors;
+  FeedMeter       meter;
+  Cutter          cutter;
+  Profiler        profiler;
+  CutJob          job;
+  CutList         cutList;
+  JobLog          jobLog;
+  bool            cutDone;                     //!< The wire end is at the blade, a job needs no trim cut
+  ControllerState state;
+  uint32_t        waitSeq;                     //!< Last segment of the running operation
+  long            learnLow;                    //!< Closest blade position that did not cut through
+  long            learnHigh;                   //!< Blade position that did
+  long            learnTry;                    //!< Position of the running test cut
+  bool            learnCut;                    //!< A test cut went through
+
+private:
+  bool start (ControllerState s, uint32_t seq);
+  void finish();
+  bool tryCut();
 
 public:
   Controller(Motors &m, Sensors &s)
     : motors(m)
     , sensors(s)
+    , meter(m)
+    , cutter(m)
+    , profiler(m)
+    , job(m, cutter, meter, profiler)
+    , cutDone(false)
+    , state(CONTROLLER_IDLE)
+    , waitSeq(0)
+    , learnLow(0)
+    , learnHigh(0)
+    , learnTry(0)
+    , learnCut(false)
   {
   }
 
   void begin();
 
-  void move(double mm);
-  void eject(double mm);
-  void cut();
+  bool learn();
+  void setWire(fix16_t diameter);
+
+  bool startJob();
+  void pause   (bool on);
+  void cancel  ();
+  bool tick    ();
+
+  void handleEvent(const SensorEvent &event);
+
+  bool            isBusy()     { return state != CONTROLLER_IDLE; }
+  ControllerState getState()   { return state;   }
+  FeedMeter      &getMeter()   { return meter;   }
+  Cutter         &getCutter()  { return cutter;  }
+  CutJob         &getJob()     { return job;     }
+  CutList        &getCutList() { return cutList; }
+  Profiler       &getProfiler(){ return profiler; }
 };
@@ -0,0 +1,397 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file CutJob.cpp
+  *
+  * Batch cut jobs.
+  */
+
+#include "CutJob.h"
+#include "Config.h"
+
+CutJob::CutJob(Motors &m, Cutter &c, FeedMeter &f, Profiler &p)
+  : motors(m)
+  , cutter(c)
+  , meter(f)
+  , profiler(p)
+  , itemCount(0)
+  , list(NULL)
+  , itemBase(0)
+  , nextItem(0)
+  , nextCount(0)
+  , prefed(0)
+  , running(false)
+  , paused(false)
+  , jammed(false)
+  , trimPending(false)
+  , queued(0)
+  , retired(0)
+  , made(0)
+  , skipped(0)
+  , total(0)
+  , startUs(0)
+  , lastUs(0)
+  , pausedUs(0)
+  , cycleUs(0)
+{
+  for (int p = 0; p < JOB_PHASES; p++) {
+    phaseUs[p] = 0;
+  }
+}
+
+/** Only while the job is not running. */
+void CutJob::clear()
+{
+  if (!running) {
+    itemCount = 0;
+    list      = NULL;
+    total     = 0;
+  }
+}
+
+bool CutJob::add(fix16_t length, uint32_t quantity)
+{
+  if (running || list || itemCount >= JOB_ITEMS || length <= 0 || quantity == 0) {
+    return false;
+  }
+  items[itemCount].length   = length;
+  items[itemCount].quantity = quantity;
+  itemCount++;
+  total += quantity;
+  return true;
+}
+
+/** Takes the items from the cut list instead, e.g. thousands of rows. Not while an import writes it. */
+bool CutJob::setList(CutList *l)
+{
+  if (running || itemCount > 0 || !l || !l->isFree() || l->getCount() == 0) {
+    return false;
+  }
+  list  = l;
+  total = list->getTotal();
+  return true;
+}
+
+/** Moves the window of the cut list on, so that it starts with the current item. */
+bool CutJob::fill()
+{
+  int keep = max(itemCount - nextItem, 0);
+
+  if (!list) {
+    return false;
+  }
+  for (int k = 0; k < keep; k++) {
+    items[k] = items[nextItem + k];
+  }
+  itemBase += nextItem;
+  nextItem  = 0;
+  itemCount = keep + list->read(itemBase + keep, items + keep, JOB_ITEMS - keep);
+  return itemCount > keep;
+}
+
+/** The job is over, the cut list may be changed again. */
+void CutJob::finish()
+{
+  running = false;
+  if (list) {
+    list->release(CUTLIST_JOB);
+  }
+}
+
+/** Starts the job. Without a cut before the wire end is not at the blade, 
+  * a trim cut puts it there first. The recipe must not be changed while the job runs.
+  * A resumed job skips the pieces already made, it may start paused.
+  */
+bool CutJob::start(bool trim, uint32_t skip, bool pause)
+{
+  if (running || (itemCount == 0 && !list) || recipe.getCount() == 0 || skip >= total || !motors.isEnabled()) {
+    return false;
+  }
+  if (list && !list->acquire(CUTLIST_JOB)) {
+    return false;                              // Import running
+  }
+  nextItem  = 0;
+  nextCount = 0;
+  if (list) {
+    itemBase  = 0;
+    itemCount = 0;
+  }
+  for (uint32_t left = skip; left > 0; ) {
+    if (nextItem >= itemCount && !fill()) {
+      break;
+    }
+
+    uint32_t n = min(left, items[nextItem].quantity);
+
+    left -= n;
+    if (n < items[nextItem].quantity) {
+      nextCount = n;
+    } else {
+      nextItem++;
+    }
+  }
+  prefed    = 0;
+  queued    = 0;
+  retired   = 0;
+  made      = skip;
+  skipped   = skip;
+  cycleUs   = 0;
+  for (int p = 0; p < JOB_PHASES; p++) {
+    phaseUs[p] = 0;
+  }
+  startUs     = micros();
+  lastUs      = startUs;
+  pausedUs    = 0;
+  paused      = pause;
+  jammed      = false;
+  trimPending = trim;
+  running     = true;
+  tick();
+  return true;
+}
+
+/** Drops everything queued, the pieces finished so far stay counted. */
+void CutJob::stop()
+{
+  if (running) {
+    finish();
+    motors.resetSteps();
+  }
+}
+
+/** The pieces already queued are finished. If the pipeline ran empty meanwhile, 
+  * the time until the resume is not counted as cycle time.
+  */
+void CutJob::pause(bool on)
+{
+  if (!running || paused == on) {
+    return;
+  }
+  tick();
+  if (!on && retired == queued) {
+    uint32_t now = micros();
+
+    pausedUs += now - lastUs;
+    lastUs    = now;
+  }
+  paused = on;
+  tick();
+}
+
+/** Length of a piece still to queue, ahead 0 is the next one. False if there is none. */
+bool CutJob::peekLength(uint32_t ahead, fix16_t &length)
+{
+  int      item = nextItem;
+  uint32_t n    = nextCount + ahead;
+
+  while (true) {
+    if (item >= itemCount) {
+      int shift = nextItem;
+
+      if (!fill()) {
+        return false;
+      }
+      item -= shift;
+    } else if (n >= items[item].quantity) {
+      n -= items[item].quantity;
+      item++;
+    } else {
+      break;
+    }
+  }
+  length = items[item].length;
+  return true;
+}
+
+/** Queues the compiled segments of the next piece. The eject runs in parallel with the 
+  * prefeed of the following piece, a sequential segment afterwards waits for both.
+  * Returns false if the motion queue has no room for the whole piece yet.
+  */
+bool CutJob::queuePiece(bool counted)
+{
+  RecipeSegment segments[RECIPE_SEGMENTS];
+  SensorStop    none   = { -1, false };
+  fix16_t       length = 0;
+  fix16_t       next   = 0;
+  fix16_t       after  = 0;
+  int           count  = 0;
+
+  if (counted && !peekLength(0, length)) {
+    return false;
+  }
+  count = recipe.compile(motors, cutter, length, prefed, !counted, segments);
+  if (peekLength(counted ? 1 : 0, next)) {
+    after = recipe.prefeed(next);
+    if (after > 0) {
+      segments[count].segment = Motors::makeSegment(-motors.toSteps(AXIS_X, after), 0, 0, true, none);
+      segments[count].phase   = JOB_EJECT;
+      count++;
+    }
+  }
+  if ((uint32_t) count > motors.getQueueSpace()) {
+    return false;
+  }
+
+  JobPiece &piece = pieces[queued & (JOB_AHEAD - 1)];
+
+  piece.first    = motors.getPushedSeq() + 1;
+  piece.count    = count;
+  piece.counted  = counted;
+  piece.length   = length;
+  piece.senseSeq = 0;
+  piece.atOut    = false;
+  piece.measured = false;
+  for (int k = 0; k < count; k++) {
+    piece.phases[k] = segments[k].phase;
+    if (segments[k].phase == JOB_SENSE && piece.senseSeq == 0) {
+      piece.senseSeq = piece.first + k;
+    }
+    motors.push(segments[k].segment);
+  }
+  if (counted) {
+    nextCount++;
+    if (nextCount >= items[nextItem].quantity) {
+      nextItem++;
+      nextCount = 0;
+    }
+  }
+  prefed = after;
+  queued++;
+  return true;
+}
+
+/** Every time span up to the finish of a segment is counted to the phase of that segment,
+  * the spans of parallel segments only once. A segment that started late, because it 
+  * was not queued in time, adds the gap before it as wait.
+  */
+void CutJob::account(const JobPiece &piece)
+{
+  uint32_t spent[JOB_PHASES] = { 0 };
+  uint32_t now               = lastUs;
+
+  for (int k = 0; k < piece.count; k++) {
+    uint32_t started = motors.getStartedUs (piece.first + k);
+    uint32_t us      = motors.getFinishedUs(piece.first + k);
+
+    if ((int32_t) (started - now) > 0) {
+      spent[JOB_WAIT] += started - now;
+      now = started;
+    }
+    if ((int32_t) (us - now) > 0) {
+      spent[piece.phases[k]] += us - now;
+      now = us;
+    }
+  }
+  if (piece.counted) {
+    for (int p = 0; p < JOB_PHASES; p++) {
+      phaseUs[p] = spent[p];
+    }
+    cycleUs = now - lastUs;
+    profiler.addPiece(spent, cycleUs);
+    made++;
+  }
+  lastUs = now;
+}
+
+/** Called by the loop task. Takes over the finished pieces and keeps up to JOB_AHEAD pieces queued. 
+  * Switching the motors off aborts the job, so does a feed to the blade sensor that never got there.
+  */
+void CutJob::tick()
+{
+  SensorTrip trip;
+  fix16_t    length = 0;
+
+  if (!running) {
+    return;
+  }
+  if (!motors.isEnabled()) {
+    finish();
+    return;
+  }
+  while (retired != queued) {
+    JobPiece &piece = pieces[retired & (JOB_AHEAD - 1)];
+
+    if (piece.senseSeq != 0 && motors.isDone(piece.senseSeq) && !motors.getTrip(piece.senseSeq, trip)) {
+      jammed = true;
+      stop();
+      return;
+    }
+    if (!motors.isDone(piece.first + piece.count - 1)) {
+      break;
+    }
+    account(piece);
+    retired++;
+  }
+  if (!paused && trimPending && queuePiece(false)) {
+    trimPending = false;
+  }
+  while (!paused && !trimPending && queued - retired < JOB_AHEAD) {
+    if (!queuePiece(true)) {
+      break;
+    }
+  }
+  if (retired == queued && !peekLength(0, length)) {
+    finish();
+  }
+}
+
+/** Called by the loop task with every sensor edge, before the tick() that retires the pieces.
+  * The out sensor rises when the wire end of a piece arrives and falls when its cut end
+  * is ejected. A piece without a trip of its blade sensor before the rising edge measures
+  * the out roller only, a trim cut measures nothing.
+  */
+void CutJob::handleEvent(const SensorEvent &event)
+{
+  SensorTrip trip;
+
+  if (!running || event.edge.channel != SENSOR_CHANNEL_Z) {
+    return;
+  }
+  for (uint32_t k = retired; k != queued; k++) {
+    JobPiece &piece = pieces[k & (JOB_AHEAD - 1)];
+
+    if (!piece.counted || piece.measured) {
+      continue;
+    }
+    if (!piece.atOut) {
+      if (event.edge.rising) {
+        if (piece.senseSeq != 0 && motors.getTrip(piece.senseSeq, trip) && (int32_t) (event.edge.us - trip.us) > 0) {
+          meter.measure(bit(AXIS_X), trip.pos, event, CUTTER_TO_OUT_SENSOR);
+        }
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+          piece.outPos[axis] = event.pos[axis];
+        }
+        piece.atOut = true;
+      }
+      return;                                  // A falling edge before is left over from the trim cut
+    }
+    piece.measured = true;
+    if (!event.edge.rising) {
+      meter.measure(bit(AXIS_Z), piece.outPos, event, piece.length);
+      return;
+    }
+    // The falling edge was missed, the rising one belongs to the next piece
+  }
+}
+
+/** Throughput since the start of the job. */
+uint32_t CutJob::getPiecesPerHour()
+{
+  uint32_t us = lastUs - startUs - pausedUs;
+
+  return us > 0 ? (uint64_t) (made - skipped) * 3600 * US_PER_S / us : 0;
+}
@@ -0,0 +1,123 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file CutJob.h
+  *
+  * Batch of pieces given as (length, quantity) entries. Every piece is made by
+  * the job's recipe, its compiled segments are queued ahead on the motion queue 
+  * as an overlapped pipeline: while the out roller ejects piece k, the in roller
+  * already feeds the start of piece k+1 through the blade. Only the remaining 
+  * feed and the cut run on their own.
+  * The start and finish times of the segments give the cycle time per phase.
+  * The out sensor edges of every piece measure the feed: the in roller from the
+  * blade sensor (a recipe with "feedto") to the out sensor, the out roller 
+  * over the piece length from the wire end to the cut end passing the out sensor.
+  */
+
+#include <Arduino.h>
+#include "Motors.h"
+#include "Recipe.h"
+#include "FeedMeter.h"
+#include "CutList.h"
+#include "Profiler.h"
+
+#define JOB_ITEMS  16                          //!< Length/quantity entries of one job, the window into a cut list
+#define JOB_AHEAD  4                           //!< Pieces queued ahead on the motion queue (power of two)
+
+/**
+  * Sequence numbers of the segments of one queued piece.
+  */
+struct JobPiece
+{
+  uint32_t first;                              //!< First segment
+  int      count;                              //!< Number of segments, they follow each other
+  uint8_t  phases[RECIPE_SEGMENTS];            //!< JobPhase per segment
+  bool     counted;                            //!< False for the trim cut at the start
+  fix16_t  length;                             //!< mm
+  uint32_t senseSeq;                           //!< Segment that feeds to the blade sensor, 0 if none
+  bool     atOut;                              //!< The wire end has reached the out sensor
+  bool     measured;                           //!< The cut end has passed the out sensor
+  long     outPos[AXIS_COUNT];                 //!< Position when the wire end reached the out sensor
+};
+
+class CutJob
+{
+private:
+  Motors   &motors;
+  Cutter   &cutter;
+  FeedMeter &meter;
+  Profiler &profiler;
+  Recipe    recipe;
+  JobItem   items[JOB_ITEMS];
+  int       itemCount;
+  CutList  *list;                              //!< Items come from the cut list, items is a window into it
+  uint32_t  itemBase;                          //!< List row of items[0]
+  int       nextItem;                          //!< Item of the next piece to queue
+  uint32_t  nextCount;                         //!< Pieces of that item queued so far
+  fix16_t   prefed;                            //!< mm of the next piece the in roller fed during the last eject
+  bool      running;
+  bool      paused;                            //!< No new pieces are queued
+  bool      jammed;                            //!< A feed to the blade sensor ran its whole length, no wire or a jam
+  bool      trimPending;                       //!< The trim cut is still to queue
+
+  JobPiece  pieces[JOB_AHEAD];
+  uint32_t  queued;                            //!< Pieces queued since the start
+  uint32_t  retired;                           //!< Pieces finished since the start
+  uint32_t  made;                              //!< Counted pieces finished
+  uint32_t  skipped;                           //!< Pieces made before a resume
+  uint32_t  total;                             //!< Counted pieces of the whole job
+
+  uint32_t  startUs;
+  uint32_t  lastUs;                            //!< Finish time of the last eject
+  uint32_t  pausedUs;                          //!< Time the job waited for a resume
+  uint32_t  phaseUs[JOB_PHASES];               //!< Of the last piece
+  uint32_t  cycleUs;                           //!< Of the last piece
+
+private:
+  bool     fill      ();
+  void     finish    ();
+  bool     peekLength(uint32_t ahead, fix16_t &length);
+  bool     queuePiece(bool counted);
+  void     account   (const JobPiece &piece);
+
+public:
+  CutJob(Motors &m, Cutter &c, FeedMeter &f, Profiler &p);
+
+  void clear();
+  bool add  (fix16_t length, uint32_t quantity);
+  bool setList(CutList *l);
+  bool start(bool trim, uint32_t skip = 0, bool pause = false);
+  void stop ();
+  void pause(bool on);
+  void tick ();
+  void handleEvent(const SensorEvent &event);
+
+  Recipe  &getRecipe()                 { return recipe;  }
+  CutList *getList()                   { return list;      }
+  int      getItemCount()              { return itemCount; }
+  const JobItem &getItem(int k)        { return items[k];  }
+  bool     isRunning()                 { return running; }
+  bool     isPaused()                  { return paused;  }
+  bool     isJammed()                  { return jammed;  }
+  uint32_t getMade()                   { return made;    }
+  uint32_t getTotal()                  { return total;   }
+  uint32_t getCycleUs()                { return cycleUs; }
+  uint32_t getPhaseUs(JobPhase p)      { return phaseUs[p]; }
+  uint32_t getPiecesPerHour();
+};
@@ -0,0 +1,290 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file CutList.cpp
+  *
+  * Cut list on the SPIFFS and its CSV import.
+  */
+
+#include "CutList.h"
+
+CutList::CutList()
+  : user(CUTLIST_FREE)
+  , count(0)
+  , total(0)
+  , newCount(0)
+  , newTotal(0)
+{
+}
+
+/** Counts the rows of the stored list, SPIFFS has to be mounted. */
+bool CutList::begin()
+{
+  File          f = SPIFFS.open(CUTLIST_FILE, FILE_READ);
+  CutListRecord record;
+
+  if (user == CUTLIST_FREE) {
+    SPIFFS.remove(CUTLIST_TEMP);               // Left by an import cut off by a reset
+  }
+  count = 0;
+  total = 0;
+  if (!f) {
+    return false;
+  }
+  while (f.read((uint8_t *) &record, sizeof(record)) == sizeof(record)) {
+    count++;
+    total += record.quantity;
+  }
+  f.close();
+  return true;
+}
+
+/** Starts a new empty list, only by the import. The stored list stays until close(true). */
+bool CutList::create()
+{
+  if (user != CUTLIST_IMPORT) {
+    return false;
+  }
+  newCount = 0;
+  newTotal = 0;
+  file     = SPIFFS.open(CUTLIST_TEMP, FILE_WRITE);
+  return file;
+}
+
+bool CutList::append(const CutListRecord &record)
+{
+  if (!file || file.write((const uint8_t *) &record, sizeof(record)) != sizeof(record)) {
+    return false;
+  }
+  newCount++;
+  newTotal += record.quantity;
+  return true;
+}
+
+/** Replaces the stored list with the new one, or drops the new one if keep is false. */
+bool CutList::close(bool keep)
+{
+  bool ok = file;
+
+  if (file) {
+    file.close();
+  }
+  if (ok && keep) {
+    SPIFFS.remove(CUTLIST_FILE);
+    ok = SPIFFS.rename(CUTLIST_TEMP, CUTLIST_FILE);
+  }
+  if (ok && keep) {
+    count = newCount;
+    total = newTotal;
+  } else {
+    SPIFFS.remove(CUTLIST_TEMP);
+    if (keep) {
+      begin();                                 // Whatever is left after a failed rename
+    }
+  }
+  return ok && keep;
+}
+
+/** Reads up to n rows from index on, returns how many. */
+int CutList::read(uint32_t index, JobItem *items, int n)
+{
+  File          f = SPIFFS.open(CUTLIST_FILE, FILE_READ);
+  CutListRecord record;
+  int           k = 0;
+
+  if (!f) {
+    return 0;
+  }
+  if (f.seek(index * sizeof(record))) {
+    while (k < n && f.read((uint8_t *) &record, sizeof(record)) == sizeof(record)) {
+      items[k].length   = record.length;
+      items[k].quantity = record.quantity;
+      k++;
+    }
+  }
+  f.close();
+  return k;
+}
+
+CsvImport::CsvImport(CutList &l)
+  : list(l)
+  , owner(NULL)
+  , active(false)
+  , lines(0)
+  , rows(0)
+  , errors(0)
+  , bytes(0)
+  , startUs(0)
+  , busyUs(0)
+  , finishUs(0)
+{
+}
+
+/** mm with up to four decimals, at most 30 m. */
+bool CsvImport::parseMm(const char *s, fix16_t &mm)
+{
+  return fix16Parse(s, mm) && mm > 0 && mm < FIX16(30001.0);
+}
+
+bool CsvImport::parseInt(const char *s, uint32_t &value)
+{
+  value = 0;
+  if (*s == 0) {
+    return false;
+  }
+  for (; *s >= '0' && *s <= '9'; s++) {
+    value = value * 10 + (*s - '0');
+    if (value > 1000000) {
+      return false;
+    }
+  }
+  return *s == 0;
+}
+
+/** Takes over the import, false if the list is used by a job or another import. */
+bool CsvImport::begin(void *request)
+{
+  if (!list.acquire(CUTLIST_IMPORT)) {
+    return false;
+  }
+  if (!list.create()) {
+    list.release(CUTLIST_IMPORT);
+    return false;
+  }
+  owner     = request;
+  active    = true;
+  quoted    = false;
+  separator = 0;
+  comment   = false;
+  field     = 0;
+  used      = 0;
+  valid     = true;
+  lines     = 0;
+  rows      = 0;
+  errors    = 0;
+  bytes     = 0;
+  busyUs    = 0;
+  startUs   = micros();
+  memset(&record, 0, sizeof(record));
+  record.quantity = 1;
+  return true;
+}
+
+/** Surrounding blanks are dropped, the label is cut to its size. */
+void CsvImport::endField()
+{
+  while (used > 0 && text[used - 1] == ' ') {
+    used--;
+  }
+  text[used] = 0;
+
+  const char *s = text;
+
+  while (*s == ' ') {
+    s++;
+  }
+  switch (field) {
+  case 0: 
+    comment = *s == '#';
+    valid   = parseMm(s, record.length); 
+    break;
+  case 1: valid = valid && (*s == 0 || parseInt(s, record.quantity)); break;
+  case 2: {
+    size_t len = strnlen(s, CUTLIST_LABEL - 1);
+    memcpy(record.label, s, len);
+    record.label[len] = 0;
+    break;
+  }
+  }
+  field++;
+  used   = 0;
+  quoted = false;
+}
+
+void CsvImport::endLine()
+{
+  bool empty = field == 0 && used == 0;
+
+  endField();
+  lines++;
+  if (!empty && !comment) {
+    if (valid && record.quantity > 0 && list.append(record)) {
+      rows++;
+    } else if (lines > 1) {
+      errors++;                                // A header line is no error
+    }
+  }
+  memset(&record, 0, sizeof(record));
+  record.quantity = 1;
+  field = 0;
+  valid = true;
+}
+
+/** One chunk of the upload, in the order they arrive. */
+void CsvImport::feed(void *request, const uint8_t *data, size_t len)
+{
+  uint32_t us = micros();
+
+  if (!isOwner(request)) {
+    return;
+  }
+  for (size_t k = 0; k < len; k++) {
+    char c = data[k];
+
+    if (c == '"') {
+      quoted = !quoted;
+    } else if (!quoted && (c == separator || (separator == 0 && (c == ',' || c == ';' || c == '\t')))) {
+      separator = c;
+      endField();
+    } else if (!quoted && c == '\n') {
+      endLine();
+    } else if (c != '\r' && used < CSV_FIELD - 1) {
+      text[used++] = c;
+    }
+  }
+  bytes  += len;
+  busyUs += micros() - us;
+}
+
+/** Finishes the last line, replaces the stored list and hands it back. */
+bool CsvImport::end(void *request)
+{
+  if (!isOwner(request)) {
+    return false;
+  }
+  if (field > 0 || used > 0) {
+    endLine();
+  }
+  list.close(true);
+  list.release(CUTLIST_IMPORT);
+  active   = false;
+  finishUs = micros();
+  return true;
+}
+
+/** The upload broke off, e.g. the client disconnected. The stored list stays as it was. */
+void CsvImport::abort(void *request)
+{
+  if (!isOwner(request)) {
+    return;
+  }
+  list.close(false);
+  list.release(CUTLIST_IMPORT);
+  owner    = NULL;
+  active   = false;
+  finishUs = micros();
+}
@@ -0,0 +1,145 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file CutList.h
+  *
+  * Cut list on the SPIFFS, e.g. thousands of (length, quantity, label) rows.
+  * The rows are appended as fixed size records while they are imported and are
+  * read back in small windows by the running job, so no part of the list 
+  * has to fit into the RAM. The CSV import parses the rows as the chunks of 
+  * an upload arrive, in constant memory. It writes a new file which replaces
+  * the stored list only when the upload is complete.
+  */
+
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "Fixed.h"
+
+#define CUTLIST_FILE   "/cutlist.bin"
+#define CUTLIST_TEMP   "/cutlist.tmp"          //!< The import is written here and renamed when complete
+#define CUTLIST_LABEL  16                      //!< Label characters kept per row, including the terminating 0
+#define CSV_FIELD      24                      //!< Characters kept per CSV field
+
+/**
+  * One entry of a job, as the job reads it from the list.
+  */
+struct JobItem
+{
+  fix16_t  length;                             //!< mm
+  uint32_t quantity;
+};
+
+/**
+  * One row of the list as it is stored.
+  */
+struct CutListRecord
+{
+  fix16_t  length;                             //!< mm
+  uint32_t quantity;
+  char     label[CUTLIST_LABEL];
+};
+
+/**
+  * Who uses the list. The import runs in the web server task, the job in the loop task,
+  * only one of them may have the list at a time.
+  */
+enum CutListUser {
+  CUTLIST_FREE, CUTLIST_IMPORT, CUTLIST_JOB
+};
+
+class CutList
+{
+private:
+  volatile int user;
+  File         file;                           //!< Open for appending during an import
+  uint32_t     count;                          //!< Rows
+  uint32_t     total;                          //!< Pieces of all rows
+  uint32_t     newCount;                       //!< Rows of the running import
+  uint32_t     newTotal;                       //!< Pieces of the running import
+
+public:
+  CutList();
+
+  bool begin();
+
+  bool acquire(CutListUser u)       { return __sync_bool_compare_and_swap(&user, CUTLIST_FREE, u); }
+  void release(CutListUser u)       { __sync_bool_compare_and_swap(&user, u, CUTLIST_FREE); }
+  bool isFree()                     { return user == CUTLIST_FREE; }
+
+  bool create();
+  bool append(const CutListRecord &record);
+  bool close (bool keep);
+  int  read  (uint32_t index, JobItem *items, int n);
+
+  uint32_t getCount()               { return count; }
+  uint32_t getTotal()               { return total; }
+};
+
+/**
+  * Streaming CSV parser, "length,quantity,label" per line. The first comma, semicolon 
+  * or tab found is taken as separator, so with semicolons the length may have a 
+  * decimal comma. Fields may be quoted. Empty lines and lines starting with '#' are 
+  * skipped, a first line without a length is taken as header.
+  */
+class CsvImport
+{
+private:
+  CutList  &list;
+  void     *owner;                             //!< Request of the running import
+  bool      active;
+  bool      quoted;
+  char      separator;                         //!< 0 until the first one is found
+  bool      comment;                           //!< The line starts with '#'
+  int       field;                             //!< Index of the current field
+  int       used;                              //!< Characters in text
+  char      text[CSV_FIELD];
+  CutListRecord record;
+  bool      valid;                             //!< All fields so far could be parsed
+
+  uint32_t  lines;
+  uint32_t  rows;
+  uint32_t  errors;
+  uint32_t  bytes;
+  uint32_t  startUs;
+  uint32_t  busyUs;                            //!< Time spent in the parser and the file
+  uint32_t  finishUs;                          //!< Time of the end of the import
+
+private:
+  static bool parseMm (const char *s, fix16_t &mm);
+  static bool parseInt(const char *s, uint32_t &value);
+
+  void endField();
+  void endLine ();
+
+public:
+  CsvImport(CutList &l);
+
+  bool begin(void *request);
+  void feed (void *request, const uint8_t *data, size_t len);
+  bool end  (void *request);
+  void abort(void *request);
+
+  bool     isOwner(void *request)   { return active && owner == request; }
+  bool     hasImported(void *request) { return owner == request; }
+  uint32_t getRows()                { return rows;    }
+  uint32_t getErrors()              { return errors;  }
+  uint32_t getBytes()               { return bytes;   }
+  uint32_t getBusyUs()              { return busyUs;  }
+  uint32_t getTotalUs()             { return (active ? micros() : finishUs) - startUs; }
+};
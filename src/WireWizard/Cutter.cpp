@@ -0,0 +1,160 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Cutter.cpp
+  *
+  * Blade stroke per wire gauge.
+  */
+
+#include "Cutter.h"
+#include "Config.h"
+
+#define CUTTER_MAGIC 0x43555431                //!< "CUT1"
+
+Cutter::Cutter(Motors &m)
+  : motors(m)
+  , gaugeCount(0)
+  , wire(0)
+  , closeSteps(CUTTER_STROKE)
+  , openSteps(0)
+  , parked(0)
+  , base(0)
+{
+}
+
+/** Loads the learned gauges, the wire in use and where the blade stopped, the SPIFFS has to be mounted. */
+bool Cutter::begin()
+{
+  File     f = SPIFFS.open(CUTTER_FILE, FILE_READ);
+  uint32_t head[4];
+
+  if (!f) {
+    return false;
+  }
+  if (f.read((uint8_t *) head, sizeof(head)) != sizeof(head) || head[0] != CUTTER_MAGIC || head[1] > CUTTER_GAUGES ||
+      f.read((uint8_t *) gauges, head[1] * sizeof(CutterGauge)) != head[1] * sizeof(CutterGauge)) {
+    gaugeCount = 0;
+    f.close();
+    return false;
+  }
+  f.close();
+  gaugeCount = head[1];
+  wire       = head[2];
+  parked     = head[3];
+  base       = parked - motors.getPosY();
+  update();
+  return true;
+}
+
+bool Cutter::save()
+{
+  File     f       = SPIFFS.open(CUTTER_FILE, FILE_WRITE);
+  uint32_t head[4] = { CUTTER_MAGIC, (uint32_t) gaugeCount, (uint32_t) wire, (uint32_t) parked };
+  bool     ok;
+
+  if (!f) {
+    return false;
+  }
+  ok = f.write((const uint8_t *) head, sizeof(head)) == sizeof(head) &&
+       f.write((const uint8_t *) gauges, gaugeCount * sizeof(CutterGauge)) == gaugeCount * sizeof(CutterGauge);
+  f.close();
+  return ok;
+}
+
+int Cutter::find(fix16_t diameter)
+{
+  for (int k = 0; k < gaugeCount; k++) {
+    if (gauges[k].diameter == diameter) {
+      return k;
+    }
+  }
+  return -1;
+}
+
+/** Without a learned position the blade closes CUTTER_STROKE, an unknown wire opens it fully. */
+void Cutter::update()
+{
+  int k = find(wire);
+
+  closeSteps = k >= 0 ? gauges[k].closeSteps : CUTTER_STROKE;
+  openSteps  = wire > 0 ? max(closeSteps - motors.toSteps(AXIS_Y, wire + CUTTER_CLEARANCE), 0L) : 0;
+}
+
+/** The wire in use, 0 if unknown. Takes effect with the next park(). */
+void Cutter::setWire(fix16_t diameter)
+{
+  diameter = max(diameter, (fix16_t) 0);
+  if (diameter != wire) {
+    wire = diameter;
+    update();
+    save();
+  }
+}
+
+/** Stores the closing position for the wire in use, a full table drops the oldest gauge. */
+bool Cutter::learn(long steps)
+{
+  int k = find(wire);
+
+  if (wire <= 0 || steps <= 0) {
+    return false;
+  }
+  if (k < 0) {
+    if (gaugeCount == CUTTER_GAUGES) {
+      memmove(gauges, gauges + 1, (CUTTER_GAUGES - 1) * sizeof(CutterGauge));
+      gaugeCount--;
+    }
+    k = gaugeCount++;
+    gauges[k].diameter = wire;
+  }
+  gauges[k].closeSteps = steps;
+  update();
+  return save();
+}
+
+/** Starts where the queued moves leave the blade. Returns the sequence number of the move, 
+  * or the last one if the blade is there already.
+  */
+uint32_t Cutter::moveTo(long steps)
+{
+  long y = steps - getEndPos();
+
+  return y != 0 ? motors.move(0, y, 0) : motors.getPushedSeq();
+}
+
+/** Moves the blade to the open position of the wire, it waits there between the cuts of a job. */
+uint32_t Cutter::park()
+{
+  return moveTo(openSteps);
+}
+
+/** Opens the blade fully. */
+uint32_t Cutter::home()
+{
+  return moveTo(0);
+}
+
+/** Stores where the blade stopped after any move, cuts and jogs included. 
+  * Nothing while the motors run, a reset then finds the last position at rest.
+  */
+void Cutter::sync()
+{
+  if (motors.isIdle() && getPos() != parked) {
+    parked = getPos();
+    save();
+  }
+}
@@ -0,0 +1,81 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file Cutter.h
+  *
+  * Blade stroke per wire gauge. Between the cuts the blade waits just above
+  * the wire instead of fully open, a cut only closes from there to where the 
+  * wire is cut through and opens again as far as the wire needs to pass.
+  * The closing position is learned per wire diameter by test cuts, an eject 
+  * that frees the out sensor proves the piece was cut through. The learned 
+  * positions are kept on the SPIFFS, together with where the blade stopped,
+  * since the step count starts at 0 after a reset.
+  */
+
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "Motors.h"
+
+#define CUTTER_FILE    "/cutter.bin"
+#define CUTTER_GAUGES  8                       //!< Wire diameters with a learned closing position
+
+/**
+  * Learned closing position of one wire diameter.
+  */
+struct CutterGauge
+{
+  fix16_t diameter;                            //!< mm
+  int32_t closeSteps;                          //!< Blade position at which the wire is cut through
+};
+
+class Cutter
+{
+private:
+  Motors      &motors;
+  CutterGauge  gauges[CUTTER_GAUGES];
+  int          gaugeCount;
+  fix16_t      wire;                           //!< Diameter of the wire in use, 0 if unknown
+  long         closeSteps;                     //!< Blade position at which the wire is cut through
+  long         openSteps;                      //!< Blade position at which the wire just passes
+  long         parked;                         //!< Blade position stored on the SPIFFS
+  long         base;                           //!< Blade position at the power up
+
+private:
+  int  find  (fix16_t diameter);
+  void update();
+  bool save  ();
+  uint32_t moveTo(long steps);
+
+public:
+  Cutter(Motors &m);
+
+  bool begin  ();
+  void setWire(fix16_t diameter);
+  bool learn  (long steps);
+  uint32_t park();
+  uint32_t home();
+  void     sync();
+
+  fix16_t getWire()                    { return wire;       }
+  long    getClose()                   { return closeSteps; }
+  long    getOpen()                    { return openSteps;  }
+  long    getPos()                     { return motors.getPosY() + base; }
+  long    getEndPos()                  { return motors.getEndPos(AXIS_Y) + base; }
+  bool    isLearned()                  { return find(wire) >= 0; }
+};
@@ -23,13 +23,38 @@
 #include <SPI.h>
 #include <TFT_eSPI.h>
 #include "Display.h"
+#include "Config.h"
+
+#if LV_COLOR_DEPTH != 16 || LV_COLOR_16_SWAP == 0
+#error "displayFlush sends the lvgl buffers as they are, set LV_COLOR_16_SWAP 1 in lv_conf.h"
+#endif
 
 #define DISP_TASK_PRO   2
 #define DISP_TASK_CORE  1
 #define DISP_TASK_STACK 4096 * 2
+#define DISP_BUF_LINES  10             //!< Lines of one draw buffer
+#define DISP_SENSOR_MS  200            //!< Shortest time between two updates of a sensor label
+#define DISP_NOISE      8              //!< Sensor changes that are not shown
+
+#define TOUCH_TASK_PRO  3
+#define TOUCH_TASK_CORE 1
+#define TOUCH_PERIOD_MS 10             //!< Sampling while pressed
+#define TOUCH_PRESSURE  400            //!< Smallest raw z of a touch
+#define TOUCH_FILTER    2              //!< Exponential filter, a new point weighs 1/4
+#define TOUCH_QUEUE     8              //!< Points waiting for lvgl
+
+#ifdef TOUCH_IRQ                       // User_Setup.h, XPT2046 PENIRQ is low while pressed
+#define TOUCH_WAIT      portMAX_DELAY
+#else
+#define TOUCH_WAIT      pdMS_TO_TICKS(30)  //!< Polling period without PENIRQ
+#endif
 
 TaskHandle_t lv_disp_tcb = NULL;
 
+static TaskHandle_t      touchTaskHandle = NULL;
+static QueueHandle_t     touchQueue      = NULL;
+static SemaphoreHandle_t busMutex        = NULL;  // Display flushes or touch readings
+
 #define LCD_EN		  GPIO_NUM_5     
 #define LCD_BLK_ON  digitalWrite(LCD_EN, LOW)
 #define LCD_BLK_OFF digitalWrite(LCD_EN, HIGH)
@@ -37,53 +62,154 @@ TaskHandle_t lv_disp_tcb = NULL;
 TFT_eSPI tft = TFT_eSPI(TFT_HEIGHT, TFT_WIDTH); 
 
 static lv_disp_buf_t disp_buf;
-static lv_color_t    color_buf[TFT_WIDTH * 10];
+static lv_color_t    color_buf [TFT_WIDTH * DISP_BUF_LINES];
+static lv_color_t    color_buf2[TFT_WIDTH * DISP_BUF_LINES];
+static bool          dmaActive = false;  // The SPI bus is held for a dma transfer
 
 Display *Display::display = NULL;
 
 Display::Display()
 {
-  display = this;
+  display      = this;
+  bindingCount = 0;
 
-  valueX  = "x";
-  valueY  = "y";
-  valueZ  = "z";
+  memset(&view, 0, sizeof(view));
 }
 
+/** Starts the dma transfer of the band and returns at once, lvgl renders the next band 
+  * into the other buffer meanwhile. pushImageDMA waits for the transfer before, so a 
+  * buffer is only rendered again after its own transfer is done.
+  * lvgl renders in panel byte order (LV_COLOR_16_SWAP), the band goes out as it is.
+  */
 void Display::displayFlush(lv_disp_drv_t *disp, const lv_area_t *area, lv_color_t *color_p)
 {
   uint32_t w = (area->x2 - area->x1 + 1);
   uint32_t h = (area->y2 - area->y1 + 1);
 
-  tft.startWrite();
-  tft.setAddrWindow(area->x1, area->y1, w, h);
-  tft.pushColors(&color_p->full, w * h, true);
-  tft.endWrite();
+  if (!dmaActive) {
+    tft.startWrite();
+    dmaActive = true;
+  }
+  tft.pushImageDMA(area->x1, area->y1, w, h, &color_p->full);
 
   lv_disp_flush_ready(disp);
 }
 
-bool Display::readTouch(lv_indev_drv_t * indev, lv_indev_data_t * data)
+/** Ends the dma output before anything else uses the SPI bus. */
+void Display::flushWait()
+{
+  if (dmaActive) {
+    tft.dmaWait();
+    tft.endWrite();
+    dmaActive = false;
+  }
+}
+
+/** Time of a full screen redraw including the transfer. */
+uint32_t Display::measureRedraw()
+{
+  uint32_t startUs = micros();
+
+  lv_obj_invalidate(lv_scr_act());
+  lv_refr_now(NULL);
+  flushWait();
+  return micros() - startUs;
+}
+
+#ifdef TOUCH_IRQ
+/** PENIRQ went low: the level interrupt stays off until the touch task saw the release. */
+void IRAM_ATTR Display::touchIsr()
+{
+  BaseType_t woken = pdFALSE;
+
+  gpio_intr_disable((gpio_num_t) TOUCH_IRQ);
+  vTaskNotifyGiveFromISR(touchTaskHandle, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+#endif
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c)
+{
+  return max(min(a, b), min(max(a, b), c));
+}
+
+/** One filtered point in screen coordinates, false if the screen is not pressed.
+  * The median of three raw readings drops single outliers, the exponential filter the jitter.
+  */
+bool Display::sampleTouch(TouchPoint &point)
 {
-  static uint16_t last_x = 0;
-  static uint16_t last_y = 0;
+  uint16_t x[3];
+  uint16_t y[3];
+  uint16_t z;
+
+  xSemaphoreTake(busMutex, portMAX_DELAY);
+  z = tft.getTouchRawZ();
+  for (int k = 0; k < 3 && z >= TOUCH_PRESSURE; k++) {
+    tft.getTouchRaw(&x[k], &y[k]);
+  }
+  xSemaphoreGive(busMutex);
 
-  uint16_t touchX=0, touchY=0;
+  if (z < TOUCH_PRESSURE) {
+    return false;
+  }
 
-  boolean touched = tft.getTouch(&touchX, &touchY);
+  uint16_t rawX = median3(x[0], x[1], x[2]);
+  uint16_t rawY = median3(y[0], y[1], y[2]);
 
-  if (touched != false) {
-    last_x        = touchX;
-    last_y        = touchY;
-    data->point.x = last_x;
-    data->point.y = last_y;
-    data->state   = LV_INDEV_STATE_PR;
+  tft.convertRawXY(&rawX, &rawY);
+  if (rawX >= tft.width() || rawY >= tft.height()) {
+    return false;
+  }
+  if (point.pressed) {
+    point.x += ((int16_t) rawX - point.x) >> TOUCH_FILTER;
+    point.y += ((int16_t) rawY - point.y) >> TOUCH_FILTER;
   } else {
-    data->point.x = last_x;
-    data->point.y = last_y;
-    data->state   = LV_INDEV_STATE_REL;
+    point.x = rawX;
+    point.y = rawY;
+  }
+  return true;
+}
+
+/** Sleeps until PENIRQ, then samples every TOUCH_PERIOD_MS while the screen is pressed
+  * and queues the points for lvgl. Nothing is read from the touch controller otherwise.
+  * Without TOUCH_IRQ it checks the pressure every TOUCH_WAIT instead.
+  */
+void Display::touchTask(void *parg)
+{
+  Display   *display = (Display *) parg;
+  TouchPoint point   = { 0, 0, false };
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, TOUCH_WAIT);
+
+    while (display->sampleTouch(point)) {
+      point.pressed = true;
+      xQueueSend(touchQueue, &point, 0);
+      vTaskDelay(pdMS_TO_TICKS(TOUCH_PERIOD_MS));
+    }
+    if (point.pressed) {
+      point.pressed = false;
+      xQueueSend(touchQueue, &point, 0);
+    }
+#ifdef TOUCH_IRQ
+    vTaskDelay(pdMS_TO_TICKS(TOUCH_PERIOD_MS));  // A PENIRQ stuck low can't keep the bus busy
+    gpio_intr_enable((gpio_num_t) TOUCH_IRQ);
+#endif
   }
-  return false;
+}
+
+/** Takes the points of the touch task, no bus access. */
+bool Display::readTouch(lv_indev_drv_t * indev, lv_indev_data_t * data)
+{
+  static TouchPoint last = { 0, 0, false };
+
+  xQueueReceive(touchQueue, &last, 0);
+  data->point.x = last.x;
+  data->point.y = last.y;
+  data->state   = last.pressed ? LV_INDEV_STATE_PR : LV_INDEV_STATE_REL;
+  return uxQueueMessagesWaiting(touchQueue) > 0;
 }
 
 void Display::buttonEvent(lv_obj_t *button, lv_event_t event) 
@@ -171,6 +297,45 @@ void Display::setLabelText(lv_obj_t *label, String text)
   lv_label_set_text(label, text.c_str());
 }
 
+/** Creates a label that follows the value at source, a member of view. */
+bool Display::bindLabel(int16_t posX, int16_t posY, const char *prefix, const int32_t *source, int32_t deadband, uint32_t periodMs)
+{
+  if (bindingCount >= DISP_BINDINGS) {
+    return false;
+  }
+
+  LabelBinding &binding = bindings[bindingCount++];
+
+  binding.label     = createLabel(posX, posY, prefix);
+  binding.prefix    = prefix;
+  binding.source    = source;
+  binding.shown     = INT32_MIN;                 // Shown at the first update
+  binding.deadband  = deadband;
+  binding.periodMs  = periodMs;
+  binding.updatedMs = millis() - periodMs;
+  return true;
+}
+
+/** Sets only the labels whose value changed, lvgl redraws nothing else. */
+void Display::updateBindings()
+{
+  uint32_t now = millis();
+
+  for (int k = 0; k < bindingCount; k++) {
+    LabelBinding &binding = bindings[k];
+    int32_t       value   = *binding.source;
+
+    if (now - binding.updatedMs < binding.periodMs || 
+        (binding.shown != INT32_MIN && abs(value - binding.shown) <= binding.deadband)) {
+      continue;
+    }
+    snprintf(binding.text, sizeof(binding.text), "%s%ld", binding.prefix, (long) value);
+    lv_label_set_static_text(binding.label, binding.text);
+    binding.shown     = value;
+    binding.updatedMs = now;
+  }
+}
+
 lv_obj_t *Display::createButton(int16_t posX, int16_t posY, int16_t sizeX, int16_t sizeY, String text)
 {
   lv_obj_t *button = lv_btn_create(lv_scr_act(), NULL);
@@ -242,16 +407,28 @@ IRAM_ATTR void Display::displayTask(void *parg)
 
     display->buttonStart = display->createButton( 320, 210, 70, 50, "Start");
 
-    lv_obj_t *labelX = display->createLabel(320, 120, display->valueX);
-    lv_obj_t *labelY = display->createLabel(320, 140, display->valueY);
-    lv_obj_t *labelZ = display->createLabel(320, 160, display->valueZ);
+    display->bindLabel(320, 120, "X: ", &display->view.sensor[SENSOR_CHANNEL_X], DISP_NOISE, DISP_SENSOR_MS);
+    display->bindLabel(320, 140, "Y: ", &display->view.sensor[SENSOR_CHANNEL_Y], DISP_NOISE, DISP_SENSOR_MS);
+    display->bindLabel(320, 160, "Z: ", &display->view.sensor[SENSOR_CHANNEL_Z], DISP_NOISE, DISP_SENSOR_MS);
+
+    if (DEBUG_DISPLAY) {
+      uint32_t redrawUs;
+
+      xSemaphoreTake(busMutex, portMAX_DELAY);
+      redrawUs = display->measureRedraw();
+      xSemaphoreGive(busMutex);
+      Serial.println((String) "Display: full redraw " + redrawUs + " us");
+    }
 
     while (1) {
-      display->setLabelText(labelX, display->valueX);
-      display->setLabelText(labelY, display->valueY);
-      display->setLabelText(labelZ, display->valueZ);
+      telemetry.read(display->view);
+      display->updateBindings();
 
+      // The touch task may read between two passes
+      xSemaphoreTake(busMutex, portMAX_DELAY);
       lv_task_handler();
+      flushWait();
+      xSemaphoreGive(busMutex);
       vTaskDelay(5);
     }
   }
@@ -266,12 +443,13 @@ void Display::begin()
   tft.begin();
   tft.initDMA();
   tft.setRotation(1);
+  tft.setSwapBytes(false);                     // LV_COLOR_16_SWAP, lvgl renders in panel byte order
   delay(100);
 
   tft.fillScreen(TFT_WHITE);
 
   lv_init(); 
-  lv_disp_buf_init(&disp_buf, color_buf, NULL, TFT_WIDTH * 10);
+  lv_disp_buf_init(&disp_buf, color_buf, color_buf2, TFT_WIDTH * DISP_BUF_LINES);
 
   // Initialize the display
   lv_disp_drv_t disp_drv;
@@ -289,6 +467,14 @@ void Display::begin()
   indev_drv.read_cb = readTouch;
   lv_indev_drv_register(&indev_drv);
 
-  // Starting display task
+  // Starting display task, the touch task wakes up on PENIRQ or polls
+  busMutex   = xSemaphoreCreateMutex();
+  touchQueue = xQueueCreate(TOUCH_QUEUE, sizeof(TouchPoint));
   xTaskCreatePinnedToCore(displayTask, "displayTask", DISP_TASK_STACK, this, DISP_TASK_PRO, &lv_disp_tcb, DISP_TASK_CORE);
+  xTaskCreatePinnedToCore(touchTask,   "touchTask",   4096,            this, TOUCH_TASK_PRO, &touchTaskHandle, TOUCH_TASK_CORE);
+
+#ifdef TOUCH_IRQ
+  pinMode(TOUCH_IRQ, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(TOUCH_IRQ), touchIsr, ONLOW);
+#endif
 }
@@ -20,28 +20,64 @@
   * @file Display.h
   * 
   * lvgl interface to the ST7796_DRIVER display
+  * With TOUCH_IRQ in User_Setup.h the XPT2046 touch controller is only read while 
+  * its PENIRQ line reports a press, without it the touch task polls the pressure.
   */
 
 #include <lvgl.h>
 #include "EventQueue.h"
+#include "Telemetry.h"
 
+#define DISP_BINDINGS   8                      //!< Labels bound to a value
+#define DISP_LABEL_TEXT 24                     //!< Text of a bound label including the value
+
+/**
+  * Label that shows a value of the telemetry snapshot. It is only set again when the value 
+  * moved by more than the deadband, and at most every periodMs, so an unchanged screen 
+  * costs nothing.
+  */
+struct LabelBinding
+{
+  lv_obj_t               *label;
+  const char             *prefix;              //!< Text before the value
+  const int32_t          *source;               //!< Into the snapshot of the display task
+  int32_t                 shown;               //!< Value on the label
+  int32_t                 deadband;            //!< Smaller changes are not shown
+  uint32_t                periodMs;            //!< Shortest time between two updates
+  uint32_t                updatedMs;
+  char                    text[DISP_LABEL_TEXT];  //!< Static text of the label
+};
+
+/**
+  * Filtered touch point for lvgl.
+  */
+struct TouchPoint
+{
+  int16_t x;
+  int16_t y;
+  bool    pressed;
+};
 
 class Display
 {
 private:
   static Display *display;  
 
-  String valueX;
-  String valueY;
-  String valueZ;
+  TelemetryData view;                          //!< Last snapshot, only used by the display task
+
+  LabelBinding bindings[DISP_BINDINGS];
+  int          bindingCount;
 
 private:
   static IRAM_ATTR void displayTask(void *parg);
+  static void touchTask(void *parg);
+  static void touchIsr ();
 
   static void displayFlush (lv_disp_drv_t *disp, const lv_area_t *area, lv_color_t *color_p);
   static bool readTouch    (lv_indev_drv_t *indev, lv_indev_data_t *data);
   static void buttonEvent  (lv_obj_t *obj,    lv_event_t event);
   static void sliderEvent  (lv_obj_t *slider, lv_event_t event);
+  static void flushWait    ();
 
 private:
   bool enabled = true;
@@ -69,13 +105,14 @@ private:
   lv_obj_t *createSlider (int16_t posX, int16_t posY, int16_t sizeX, int16_t sizeY, int min, int max, int standard);
 
   void      setLabelText (lv_obj_t *label, String text);
+  bool      bindLabel    (int16_t posX, int16_t posY, const char *prefix, const int32_t *source, int32_t deadband, uint32_t periodMs);
+  void      updateBindings();
+  uint32_t  measureRedraw();
+  bool      sampleTouch  (TouchPoint &point);
 
 public: 
   Display();
 
-  void setValueX(String x) { valueX = x; };
-  void setValueY(String y) { valueY = y; };
-  void setValueZ(String z) { valueZ = z; };
 
   void begin();
 };
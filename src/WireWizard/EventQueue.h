@@ -31,18 +31,20 @@ class Event
 public:
   enum PushButton { 
     X_LEFT, X_RIGHT, Y_LEFT, Y_RIGHT, Z_LEFT, Z_RIGHT, 
-    ON, OFF, STEPS, SPEED, START
+    ON, OFF, STEPS, SPEED, START, WIRE, LEARN
   };
 
 public:
   PushButton pushButton;
   int        speed;
   int        steps;
+  int        wire;                             //!< Diameter in 1/100 mm
 
 public:
   Event() 
     : speed(20)
     , steps(20)
+    , wire(0)
   {
   }
 };
@@ -68,9 +70,10 @@ public:
     return uxQueueMessagesWaiting(eventQueue) > 0;
   }
 
-  bool receive(Event &event) 
+  /** Waits up to wait ticks for an event. */
+  bool receive(Event &event, TickType_t wait = 0) 
   {
-    return pdPASS == xQueueReceive(eventQueue, &event, 0);
+    return pdPASS == xQueueReceive(eventQueue, &event, wait);
   }
 };
 
@@ -0,0 +1,83 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file FeedMeter.cpp
+  *
+  * Closed loop wire length measurement.
+  */
+
+#include "FeedMeter.h"
+#include "Config.h"
+
+FeedMeter::FeedMeter(Motors &m)
+  : motors(m)
+  , tolerance(FEED_TOLERANCE)
+  , autoCorrect(FEED_AUTO_CORRECT)
+  , count(0)
+  , slips(0)
+{
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    measured[axis] = 0;
+    error   [axis] = 0;
+  }
+}
+
+/** The wire moved mm from the start position to the sensor edge of the event. */
+void FeedMeter::measure(uint8_t axisMask, const long start[AXIS_COUNT], const SensorEvent &event, fix16_t mm)
+{
+  bool slipped = false;
+
+  if (mm <= 0) {
+    return;
+  }
+  count++;
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    if (!bitRead(axisMask, axis)) {
+      continue;
+    }
+    long    steps      = abs(event.pos[axis] - start[axis]);
+    fix16_t configured = motors.getAxis((Axis) axis).stepsPerMm;
+
+    measured[axis] = ((int64_t) steps << 32) / mm;
+    error   [axis] = ((int64_t) (measured[axis] - configured) << FIX16_SHIFT) / configured;
+
+    if (abs(error[axis]) > tolerance) {
+      slipped = true;
+    }
+    if (autoCorrect) {
+      correct((Axis) axis);
+    }
+  }
+  if (slipped) {
+    slips++;
+  }
+}
+
+/** Moves the steps/mm a part of the way to the measured value. A deviation too big 
+  * for wear or roller pressure (a jam, no wire) is left alone.
+  */
+void FeedMeter::correct(Axis axis)
+{
+  if (abs(error[axis]) > FEED_MAX_CORRECTION) {
+    return;
+  }
+
+  AxisConfig config = motors.getAxis(axis);
+
+  config.stepsPerMm += (measured[axis] - config.stepsPerMm) >> FEED_CORRECT_SHIFT;
+  motors.setAxis(axis, config);
+}
@@ -0,0 +1,58 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file FeedMeter.h
+  *
+  * Closed loop wire length measurement. A measurement starts at a known
+  * wire position (e.g. the wire end at the blade sensor) and ends with the 
+  * sensor edge at a known distance. The steps the feed axes did in between
+  * give the real steps/mm, a deviation above the tolerance counts as slip.
+  */
+
+#include <Arduino.h>
+#include "Motors.h"
+
+class FeedMeter
+{
+private:
+  Motors    &motors;
+  fix16_t    tolerance;                        //!< Relative deviation accepted without a slip
+  bool       autoCorrect;
+
+  fix16_t    measured[AXIS_COUNT];             //!< Last measured steps/mm
+  fix16_t    error   [AXIS_COUNT];             //!< Last relative deviation from the configured steps/mm
+  uint32_t   count;
+  uint32_t   slips;
+
+private:
+  void correct(Axis axis);
+
+public:
+  FeedMeter(Motors &m);
+
+  void measure(uint8_t axisMask, const long start[AXIS_COUNT], const SensorEvent &event, fix16_t mm);
+
+  void setTolerance  (fix16_t t)    { tolerance   = t;  }
+  void setAutoCorrect(bool on)      { autoCorrect = on; }
+
+  fix16_t  getMeasured(Axis axis)   { return measured[axis]; }
+  fix16_t  getError   (Axis axis)   { return error[axis];    }
+  uint32_t getCount()               { return count;          }
+  uint32_t getSlips()               { return slips;          }
+};
@@ -0,0 +1,106 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file Fixed.h
+  *
+  * Q16.16 fixed point helpers for the motion path. The ESP32 has no double 
+  * precision FPU, so lengths and factors are converted once at compile time
+  * and everything after that runs on integers.
+  */
+
+#include <Arduino.h>
+
+typedef int32_t fix16_t;                       //!< Q16.16, 16 integer and 16 fractional bits
+
+#define FIX16_SHIFT  16
+#define FIX16_ONE    ((fix16_t) 1 << FIX16_SHIFT)
+
+#define US_PER_S     1000000UL
+#define US_RECIP_32  ((((uint64_t) 1 << 32) + US_PER_S / 2) / US_PER_S)   //!< 2^32 / 1000000, x / 1000000 = x * US_RECIP_32 >> 32
+
+/** Conversion of a constant, e.g. FIX16(10000.0 / 260), is folded by the compiler. */
+constexpr fix16_t FIX16(double value)
+{
+  return (fix16_t) (value * FIX16_ONE + (value < 0 ? -0.5 : 0.5));
+}
+
+constexpr long fix16ToLong(fix16_t value)
+{
+  return (value + FIX16_ONE / 2) >> FIX16_SHIFT;
+}
+
+/** Product of two Q16.16 values, rounded. */
+inline fix16_t fix16Mul(fix16_t a, fix16_t b)
+{
+  return (fix16_t) (((int64_t) a * b + FIX16_ONE / 2) >> FIX16_SHIFT);
+}
+
+/** Decimal number with up to four decimals, e.g. "12.5" or "12,5", without floating point. 
+  * False for anything else than digits and one decimal point or if it does not fit.
+  */
+inline bool fix16Parse(const char *s, fix16_t &value)
+{
+  uint32_t whole    = 0;
+  uint32_t fraction = 0;
+  uint32_t scale    = 1;
+  bool     digits   = false;
+
+  for (; *s >= '0' && *s <= '9'; s++) {
+    whole  = whole * 10 + (*s - '0');
+    digits = true;
+    if (whole > 32767) {
+      return false;
+    }
+  }
+  if (*s == '.' || *s == ',') {
+    for (s++; *s >= '0' && *s <= '9'; s++) {
+      if (scale < 10000) {
+        fraction = fraction * 10 + (*s - '0');
+        scale   *= 10;
+      }
+      digits = true;
+    }
+  }
+  if (!digits || *s != 0) {
+    return false;
+  }
+  value = (fix16_t) ((whole << FIX16_SHIFT) + (((uint64_t) fraction << FIX16_SHIFT) + scale / 2) / scale);
+  return value >= 0;
+}
+
+/** Integer square root, rounded down. */
+inline uint32_t isqrt(uint64_t value)
+{
+  uint64_t result = 0;
+  uint64_t bit    = (uint64_t) 1 << 62;
+
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (value >= result + bit) {
+      value  -= result + bit;
+      result  = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t) result;
+}
@@ -0,0 +1,121 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file I2SOut.cpp
+  *
+  * I2S-DMA streaming to the 74HC595 shift register.
+  */
+
+#include "I2SOut.h"
+
+I2SOut::I2SOut()
+  : count(0)
+  , drainUs(0)
+  , restart(true)
+  , underruns(0)
+{
+}
+
+bool I2SOut::begin(int latchPin, int clockPin, int dataPin)
+{
+  i2s_config_t config = {};
+
+  config.mode                 = (i2s_mode_t) (I2S_MODE_MASTER | I2S_MODE_TX);
+  config.sample_rate          = I2S_OUT_SAMPLE_RATE;
+  config.bits_per_sample      = I2S_BITS_PER_SAMPLE_16BIT;
+  config.channel_format       = I2S_CHANNEL_FMT_RIGHT_LEFT;
+  config.communication_format = I2S_COMM_FORMAT_STAND_MSB;  // No 1 bit delay: the last shifted bit is latched
+  config.intr_alloc_flags     = 0;
+  config.dma_buf_count        = I2S_OUT_DMA_COUNT;
+  config.dma_buf_len          = I2S_OUT_DMA_LEN;
+  config.use_apll             = false;
+  config.tx_desc_auto_clear   = true;    // A dry ring sends zeros instead of the old step pulses again
+
+  if (i2s_driver_install(I2S_OUT_PORT, &config, 0, NULL) != ESP_OK) {
+    return false;
+  }
+
+  i2s_pin_config_t pins = {};
+
+  pins.mck_io_num   = I2S_PIN_NO_CHANGE;
+  pins.bck_io_num   = clockPin;
+  pins.ws_io_num    = latchPin;
+  pins.data_out_num = dataPin;
+  pins.data_in_num  = I2S_PIN_NO_CHANGE;
+
+  if (i2s_set_pin(I2S_OUT_PORT, &pins) != ESP_OK) {
+    i2s_driver_uninstall(I2S_OUT_PORT);
+    return false;
+  }
+  return true;
+}
+
+/** Renders the value for the given number of samples, blocks if the dma ring is full. */
+void I2SOut::write(uint8_t value, uint32_t samples)
+{
+  uint32_t sample = ((uint32_t) value << 16) | value;  // Same value in both channels, the WS edge latches either
+
+  while (samples-- > 0) {
+    chunk[count++] = sample;
+    if (count == I2S_OUT_CHUNK) {
+      flush();
+    }
+  }
+}
+
+/** Overwrites the whole dma ring with the value, it holds for the length of the ring.
+  * After that the dma sends zeros, the following samples don't count as an underrun.
+  */
+void I2SOut::fill(uint8_t value)
+{
+  write(value, (I2S_OUT_DMA_COUNT + 1) * I2S_OUT_DMA_LEN);   // One more for a partly filled buffer
+  flush();
+  restart = true;
+}
+
+/** Drops every sample not yet out, also those already in the dma ring, and continues with the value.
+  * Until the value is through the ring it outputs zero, which is no step pulse with the drivers enabled.
+  */
+void I2SOut::stop(uint8_t value)
+{
+  count = 0;
+  i2s_zero_dma_buffer(I2S_OUT_PORT);
+  fill(value);
+}
+
+/** Hands the rendered samples over to the dma. If everything written before is out
+  * already, the dma has sent zeros in between: the motors paused, an underrun.
+  */
+void I2SOut::flush()
+{
+  if (count > 0) {
+    size_t   written = 0;
+    uint32_t now     = micros();
+
+    if (!restart && (int32_t) (now - drainUs) >= 0) {
+      underruns++;
+    }
+    i2s_write(I2S_OUT_PORT, chunk, count * sizeof(uint32_t), &written, portMAX_DELAY);
+    now     = micros();
+    drainUs = ((int32_t) (drainUs - now) > 0 ? drainUs : now) + count * I2S_OUT_SAMPLE_US;
+    if ((int32_t) (drainUs - now) > I2S_OUT_RING_US) {
+      drainUs = now + I2S_OUT_RING_US;         // The write returned with the ring full
+    }
+    count   = 0;
+    restart = false;
+  }
+}
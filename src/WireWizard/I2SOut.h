@@ -0,0 +1,66 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file I2SOut.h
+  *
+  * I2S-DMA streaming to the 74HC595 shift register.
+  * BCK drives the shift clock, WS the latch and DOUT the data pin.
+  * Every I2S word ends with the port value in the lowest byte, so the
+  * WS edge latches a new value every sample period without any CPU help.
+  * A dma buffer that is out is cleared, so a ring that runs dry sends zeros:
+  * no step pulse, a late refill costs time but never the position.
+  */
+
+#include <Arduino.h>
+#include <driver/i2s.h>
+
+#define I2S_OUT_PORT         I2S_NUM_1         //!< I2S0 stays free for the ADC
+#define I2S_OUT_SAMPLE_RATE  250000            //!< 16 bit stereo: 8 MHz shift clock
+#define I2S_OUT_SAMPLE_US    4                 //!< 1000000 / I2S_OUT_SAMPLE_RATE
+#define I2S_OUT_DMA_COUNT    8
+#define I2S_OUT_DMA_LEN      250               //!< One dma buffer is 1 ms
+#define I2S_OUT_RING_US      (I2S_OUT_DMA_COUNT * I2S_OUT_DMA_LEN * I2S_OUT_SAMPLE_US)
+#define I2S_OUT_CHUNK        64                //!< Samples rendered before they are handed over to the dma
+
+class I2SOut
+{
+private:
+  uint32_t chunk[I2S_OUT_CHUNK];
+  int      count;
+  uint32_t drainUs;                            //!< micros() when the last written sample is out
+  bool     restart;                            //!< The ring ran dry on purpose, the next samples are no underrun
+  uint32_t underruns;                          //!< Samples written after the ring ran dry
+
+public:
+  I2SOut();
+
+  bool begin (int latchPin, int clockPin, int dataPin);
+
+  void write (uint8_t value, uint32_t samples);
+  void fill  (uint8_t value);
+  void flush ();
+  void stop  (uint8_t value);
+
+  uint32_t getUnderruns()       { return underruns; }
+
+  bool isDrained()              { return count == 0 && (int32_t) (micros() - drainUs) >= 0; }
+
+  /** Time until the last written sample is out, estimated from the dma ring size. */
+  uint32_t getLeadUs()          { return count * I2S_OUT_SAMPLE_US + max((int32_t) (drainUs - micros()), (int32_t) 0); }
+};
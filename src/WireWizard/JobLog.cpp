@@ -0,0 +1,190 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file JobLog.cpp
+  *
+  * Crash-safe job log.
+  */
+
+#include "JobLog.h"
+
+#define RECORD_MAGIC 0x57495245                //!< "WIRE"
+
+JobLog::JobLog()
+  : mounted(false)
+  , committed(0)
+  , size(0)
+{
+}
+
+bool JobLog::begin()
+{
+  mounted = SPIFFS.begin(true);
+  if (!mounted) {
+    Serial.println("An Error has occurred while mounting SPIFFS");
+  }
+  return mounted;
+}
+
+uint32_t JobLog::checksum(const JobRecord &record)
+{
+  return RECORD_MAGIC ^ record.type ^ (record.a * 31) ^ (record.b * 131);
+}
+
+bool JobLog::write(File &f, uint32_t type, uint32_t a, uint32_t b)
+{
+  JobRecord record = { type, a, b, 0 };
+
+  record.check = checksum(record);
+  if (f.write((const uint8_t *) &record, sizeof(record)) != sizeof(record)) {
+    return false;
+  }
+  size += sizeof(record);
+  return true;
+}
+
+/** Writes the whole job into a new file and replaces the log with it. Until the rename the 
+  * old log stays valid, a reset right in between leaves the new file as JOB_LOG_TEMP.
+  */
+bool JobLog::create(CutJob &job, uint32_t made)
+{
+  Recipe &recipe = job.getRecipe();
+  bool    ok     = true;
+
+  if (file) {
+    file.close();
+  }
+  size = 0;
+
+  File temp = SPIFFS.open(JOB_LOG_TEMP, FILE_WRITE);
+
+  if (!temp) {
+    return false;
+  }
+  if (job.getList()) {
+    ok = write(temp, RECORD_LIST, job.getList()->getCount(), job.getList()->getTotal());
+  }
+  for (int k = 0; k < job.getItemCount() && ok && !job.getList(); k++) {
+    ok = write(temp, RECORD_ITEM, job.getItem(k).length, job.getItem(k).quantity);
+  }
+  for (int k = 0; k < recipe.getCount() && ok; k++) {
+    ok = write(temp, RECORD_STEP, recipe.getStep(k).op, recipe.getStep(k).arg);
+  }
+  ok = ok && write(temp, RECORD_START, job.getList() ? 0 : job.getItemCount(), recipe.getCount());
+  ok = ok && write(temp, RECORD_MADE,  made, 0);
+  temp.close();
+
+  if (ok) {
+    SPIFFS.remove(JOB_LOG_FILE);
+    ok = SPIFFS.rename(JOB_LOG_TEMP, JOB_LOG_FILE);
+  }
+  if (ok) {
+    file      = SPIFFS.open(JOB_LOG_FILE, FILE_APPEND);
+    committed = made;
+  }
+  return ok && file;
+}
+
+/** Records a new job, the log of the one before is dropped. */
+bool JobLog::start(CutJob &job)
+{
+  return mounted && create(job, 0);
+}
+
+/** Appends a progress record every JOB_LOG_BATCH pieces, force commits at once (e.g. on a pause). 
+  * A log grown too big is compacted into a new one with the same job.
+  */
+void JobLog::progress(CutJob &job, bool force)
+{
+  uint32_t made = job.getMade();
+
+  if (!file || made == committed || (!force && made - committed < JOB_LOG_BATCH)) {
+    return;
+  }
+  if (size + sizeof(JobRecord) > JOB_LOG_MAX) {
+    create(job, made);
+  } else if (write(file, RECORD_MADE, made, 0)) {
+    file.flush();
+    committed = made;
+  }
+}
+
+/** The job is complete or cancelled, nothing to resume. */
+void JobLog::end()
+{
+  if (file) {
+    file.close();
+  }
+  if (mounted) {
+    SPIFFS.remove(JOB_LOG_FILE);
+    SPIFFS.remove(JOB_LOG_TEMP);
+  }
+  committed = 0;
+  size      = 0;
+}
+
+/** Reads a log into the job. The records up to the first broken one count. 
+  * A job of a cut list is only restored if the list is still the same size.
+  */
+bool JobLog::read(const char *path, CutJob &job, CutList &list, uint32_t &made)
+{
+  File      f       = SPIFFS.open(path, FILE_READ);
+  JobRecord record;
+  bool      started = false;
+
+  if (!f) {
+    return false;
+  }
+  job.clear();
+  job.getRecipe().clear();
+  made = 0;
+
+  while (f.read((uint8_t *) &record, sizeof(record)) == sizeof(record) && record.check == checksum(record)) {
+    switch (record.type) {
+    case RECORD_ITEM:  job.add(record.a, record.b);                          break;
+    case RECORD_STEP:  job.getRecipe().add((RecipeOp) record.a, record.b);  break;
+    case RECORD_LIST:  
+      if (list.getCount() == record.a && list.getTotal() == record.b) {
+        job.setList(&list);
+      }
+      break;
+    case RECORD_START: started = job.getItemCount() == (int) record.a && (record.a > 0 || job.getList()); break;
+    case RECORD_MADE:  made    = record.a;                                   break;
+    }
+  }
+  f.close();
+
+  if (!started || job.getRecipe().getCount() == 0 || made >= job.getTotal()) {
+    job.clear();
+    job.getRecipe().setDefault();
+    return false;
+  }
+  return true;
+}
+
+/** Loads an unfinished job, made returns the pieces already done.
+  * The log stays open, so the resumed job appends to it.
+  */
+bool JobLog::load(CutJob &job, CutList &list, uint32_t &made)
+{
+  const char *path = SPIFFS.exists(JOB_LOG_FILE) ? JOB_LOG_FILE : JOB_LOG_TEMP;
+
+  if (!mounted || !read(path, job, list, made)) {
+    return false;
+  }
+  return create(job, made);
+}
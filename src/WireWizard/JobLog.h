@@ -0,0 +1,79 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file JobLog.h
+  *
+  * Crash-safe record of the running job on the SPIFFS. The job (items and recipe)
+  * is written once at the start, then only small progress records are appended
+  * every JOB_LOG_BATCH pieces, nothing is ever rewritten in place.
+  * A torn record at the end fails its check and is ignored, so after a reset
+  * the job resumes at the last committed piece count.
+  */
+
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "CutJob.h"
+
+#define JOB_LOG_FILE   "/job.log"
+#define JOB_LOG_TEMP   "/job.tmp"              //!< The log is built here and renamed when complete
+#define JOB_LOG_BATCH  4                       //!< Pieces per progress record
+#define JOB_LOG_MAX    8192                    //!< Size in bytes at which the log is compacted
+
+enum JobRecordType {
+  RECORD_ITEM = 0x4A31, RECORD_STEP, RECORD_START, RECORD_MADE, RECORD_LIST
+};
+
+/**
+  * One fixed size record of the log.
+  */
+struct JobRecord
+{
+  uint32_t type;
+  uint32_t a;
+  uint32_t b;
+  uint32_t check;
+};
+
+class JobLog
+{
+private:
+  bool     mounted;
+  File     file;                               //!< Kept open for appending
+  uint32_t committed;                          //!< Piece count of the last progress record
+  size_t   size;
+
+private:
+  static uint32_t checksum(const JobRecord &record);
+
+  bool write (File &f, uint32_t type, uint32_t a, uint32_t b);
+  bool read  (const char *path, CutJob &job, CutList &list, uint32_t &made);
+  bool create(CutJob &job, uint32_t made);
+
+public:
+  JobLog();
+
+  bool begin();
+
+  bool start   (CutJob &job);
+  void progress(CutJob &job, bool force = false);
+  void end     ();
+  bool load    (CutJob &job, CutList &list, uint32_t &made);
+
+  uint32_t getCommitted()              { return committed; }
+};
@@ -20,8 +20,6 @@
   * Stepper Interface
   */
 
-#include <SPI.h>
-#include <I2S.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include "Motors.h"
@@ -39,8 +37,53 @@ const int latchPin = GPIO_NUM_17;
 const int clockPin = GPIO_NUM_16;
 const int dataPin  = GPIO_NUM_21;
 
+static const short stepBits[AXIS_COUNT] = { X_STEP_BIT, Y_STEP_BIT, Z_STEP_BIT };
+static const short dirBits [AXIS_COUNT] = { X_DIR_BIT,  Y_DIR_BIT,  Z_DIR_BIT  };
+
 Motors::Motors()
+  : output(StepEngine::OUTPUT_TIMER)
+  , pushedSeq(0)
+  , startedSeq(0)
+  , completedSeq(0)
+  , abortSeq(0)
+  , abortRequest(false)
+  , activeCount(0)
+  , lastChannel(-1)
+  , clockUs(0)
+  , sensors(NULL)
+  , historyCount(0)
+  , tripLeadUs(0)
+  , overshootMm(0)
+  , edgeIndex(0)
+  , eventHead(0)
+  , eventTail(0)
+  , idleUs(0)
+  , taskHandle(NULL)
+  , wokenFromIdle(false)
+  , idleWakeups(0)
+  , startLatencyUs(0)
+  , maxStartLatencyUs(0)
 {
+  for (int c = 0; c < MOTOR_CHANNELS; c++) {
+    channels[c].active       = false;
+    channels[c].line.seq     = 0;
+    channels[c].line.planned = 0;
+  }
+  for (int k = 0; k < FINISH_HISTORY; k++) {
+    startedUs [k] = 0;
+    finishedUs[k] = 0;
+    trips[k].seq  = 0;
+  }
+  // Safe values until setAxis() is called with the tuned ones
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    stepsPerMm[axis]       = FIX16_ONE;
+    invert    [axis]       = false;
+    limits[axis].startRate = 1000;
+    limits[axis].maxRate   = 1000;
+    limits[axis].accel     = 0;
+    limits[axis].jerk      = 0;
+  }
+
   reset();
 }
 
@@ -50,35 +93,475 @@ void Motors::enable(bool en)
   if (!enabled){
     resetSteps(); 
   }
+  notify();
+}
+
+/** Wakes up the motor task if it is waiting for something to do. */
+void Motors::notify()
+{
+  if (taskHandle) {
+    xTaskNotifyGive(taskHandle);
+  }
 }
 
 void Motors::reset()
 {
   enabled       = false;
   enabledOnIdle = false;
-  currPosX      = 0;
-  currPosY      = 0;
-  currPosZ      = 0;
-  doStepsX      = 0;
-  doStepsY      = 0;
-  doStepsZ      = 0;
   delayUs       = 0;
-  beepMs        = 0;
+  beepUntil     = 0;
+  endStale      = false;
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    currPos[axis] = 0;
+    endPos [axis] = 0;
+  }
 }
 
+/** Drops everything queued so far. The motor task does the work, so the queue keeps a single consumer. */
 void Motors::resetSteps()
 {
-  doStepsX = 0;
-  doStepsY = 0;
-  doStepsZ = 0;
-  beepMs   = 0;
+  beepUntil    = xTaskGetTickCount();
+  abortSeq     = pushedSeq;
+  abortRequest = true;
+  endStale     = true;
+  notify();
+}
+
+/** Starts the end position over from the rendered one once all segments are done or dropped.
+  * A sensor stop and the feed shortened after it end short, until then they count in full.
+  */
+void Motors::syncEnd()
+{
+  while (abortRequest) {
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  if (endStale || isDone(pushedSeq)) {
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+      endPos[axis] = currPos[axis];
+    }
+    endStale = false;
+  }
+}
+
+/** Should be called while the motors are idle, the running lines keep their limits. */
+void Motors::setAxis(Axis axis, const AxisConfig &config)
+{
+  stepsPerMm[axis] = config.stepsPerMm;
+  invert    [axis] = config.invert;
+  limits    [axis] = config.limits;
+}
+
+AxisConfig Motors::getAxis(Axis axis)
+{
+  AxisConfig config;
+
+  config.stepsPerMm = stepsPerMm[axis];
+  config.invert     = invert[axis];
+  config.limits     = limits[axis];
+  return config;
+}
+
+/** Queues a coordinated move, waits only if the queue is full.
+  * A parallel move starts as soon as its axes are free, each one with its own rate.
+  * Returns the sequence number to check with isDone().
+  */
+uint32_t Motors::move(long x, long y, long z, bool parallel)
+{
+  SensorStop none = { -1, false };
+
+  return push(makeSegment(x, y, z, parallel, none));
+}
+
+/** Queues a move that decelerates as soon as the sensor edge comes.
+  * After isDone() getTrip() returns the position of the edge.
+  */
+uint32_t Motors::moveUntil(long x, long y, long z, const SensorStop &stop)
+{
+  return push(makeSegment(x, y, z, false, stop));
+}
+
+Segment Motors::makeSegment(long x, long y, long z, bool parallel, const SensorStop &stop, uint32_t dwellUs)
+{
+  Segment segment;
+
+  segment.steps[AXIS_X] = x;
+  segment.steps[AXIS_Y] = y;
+  segment.steps[AXIS_Z] = z;
+  segment.total         = max(max(abs(x), abs(y)), abs(z));
+  segment.seq           = 0;
+  segment.queuedUs      = 0;
+  segment.parallel      = parallel && segment.total > 0;
+  segment.stop          = stop;
+  segment.dwellUs       = segment.total > 0 ? 0 : dwellUs;
+  segment.afterTrip     = false;
+  return segment;
+}
+
+/** Queues a prepared segment, e.g. of a compiled recipe. Empty segments are skipped. */
+uint32_t Motors::push(const Segment &s)
+{
+  if (enabled && (s.total > 0 || s.dwellUs > 0)) {
+    Segment segment = s;
+
+    syncEnd();
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+      endPos[axis] += segment.steps[axis];
+    }
+    segment.seq      = pushedSeq + 1;
+    segment.queuedUs = micros();
+
+    while (!queue.push(segment)) {
+      vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    pushedSeq = segment.seq;
+    notify();
+  }
+  return pushedSeq;
+}
+
+/** Returns false if the move has not been stopped by its sensor (yet), or if it is too old. */
+bool Motors::getTrip(uint32_t seq, SensorTrip &trip)
+{
+  const SensorTrip &slot = trips[seq & (FINISH_HISTORY - 1)];
+
+  if (slot.seq != seq) {
+    return false;
+  }
+  __sync_synchronize();
+  trip = slot;
+  __sync_synchronize();
+  return trip.seq == seq && slot.seq == seq;
+}
+
+/** Loop task side of the sensor events, false if there is none. */
+bool Motors::getEvent(SensorEvent &event)
+{
+  if (eventTail == eventHead) {
+    return false;
+  }
+  __sync_synchronize();
+  event = events[eventTail & (SENSOR_EVENTS - 1)];
+  __sync_synchronize();
+  eventTail++;
+  return true;
+}
+
+void Motors::initLine(Line &l, const Segment &segment)
+{
+  l.total    = segment.total;
+  l.done     = 0;
+  l.axes     = 0;
+  l.parallel = segment.parallel;
+  l.seq      = segment.seq;
+  l.exitRate = 0;
+  l.planned  = 0;
+  l.stop     = segment.stop;
+  l.stopping = false;
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    l.steps[axis] = segment.steps[axis];
+    l.left [axis] = abs(l.steps[axis]);
+    if (l.steps[axis] != 0) {
+      bitSet(l.axes, axis);
+    }
+  }
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    l.error[axis] = l.total / 2;
+  }
+}
+
+/** Takes over queued segments as long as they are allowed to run.
+  * A sequential segment waits until every channel is done and carries over the rate
+  * of the previous line if that one was planned to run into it. A parallel segment 
+  * only waits until its axes are free and no sequential line runs, so it never
+  * overtakes a sequential segment queued before it.
+  */
+void Motors::startLines()
+{
+  Segment *segment = NULL;
+
+  while ((segment = queue.peek()) != NULL) {
+    int      c         = -1;
+    uint32_t entryRate = 0;
+    uint32_t dueUs     = clockUs;
+
+    if (segment->parallel) {
+      for (int k = 0; k < MOTOR_CHANNELS; k++) {
+        Channel &ch = channels[k];
+
+        if (!ch.active) {
+          c = c < 0 ? k : c;
+        } else if (!ch.line.parallel) {
+          return;
+        } else {
+          for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            if (bitRead(ch.line.axes, axis) && segment->steps[axis] != 0) {
+              return;
+            }
+          }
+        }
+      }
+      if (c < 0) {
+        return;
+      }
+    } else {
+      if (activeCount > 0) {
+        return;
+      }
+      c = max(lastChannel, 0);
+
+      Channel &last = channels[c];
+
+      if (last.line.planned > 0 && segment->seq == last.line.seq + 1) {
+        Junction j = Planner::junction(limits, last.line.steps, last.line.total, segment->steps, segment->total);
+
+        entryRate = ((uint64_t) min(last.planner.getRate(), last.line.exitRate) * j.ratio) >> FIX16_SHIFT;
+        dueUs     = last.dueUs;
+      }
+    }
+    if (wokenFromIdle) {
+      startLatencyUs    = micros() - segment->queuedUs;
+      maxStartLatencyUs = max(maxStartLatencyUs, startLatencyUs);
+      wokenFromIdle     = false;
+    }
+
+    Channel &ch   = channels[c];
+    Segment  next = *segment;
+
+    if (next.afterTrip) {
+      shortenByTrip(next);
+    }
+    // Its first step is output dueUs - clockUs after the frames already pushed
+    startedUs[segment->seq & (FINISH_HISTORY - 1)] = micros() + engine.getLeadUs() + max((int32_t) (dueUs - clockUs), (int32_t) 0);
+    dueUs += segment->dwellUs;
+    initLine(ch.line, next);
+    queue.pop();
+
+    ch.planner.start(lineLimits(ch.line.steps, ch.line.total), entryRate);
+    ch.dueUs   = dueUs;
+    ch.line.startUs = dueUs;
+    ch.active  = true;
+    startedSeq = ch.line.seq;
+    activeCount++;
+    lookAhead(ch);
+  }
+}
+
+/** The wire ran overshootMm past the edge of the last sensor move, every axis of the 
+  * segment feeds that much less. Taken once, a later segment isn't shortened again.
+  */
+void Motors::shortenByTrip(Segment &segment)
+{
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    long steps = segment.steps[axis];
+    long cut   = min(toSteps((Axis) axis, overshootMm), abs(steps));
+
+    segment.steps[axis] = steps > 0 ? steps - cut : steps + cut;
+  }
+  segment.total = max(max(abs(segment.steps[AXIS_X]), abs(segment.steps[AXIS_Y])), abs(segment.steps[AXIS_Z]));
+  overshootMm   = 0;
+}
+
+/** A sensor move keeps how far its leading axis ran past the edge, 0 if the sensor didn't trip. */
+void Motors::finishLine(int c)
+{
+  Line &l = channels[c].line;
+
+  if (l.stop.sensor >= 0) {
+    const SensorTrip &trip = trips[l.seq & (FINISH_HISTORY - 1)];
+    int               lead = 0;
+
+    for (int axis = 1; axis < AXIS_COUNT; axis++) {
+      lead = abs(l.steps[axis]) > abs(l.steps[lead]) ? axis : lead;
+    }
+    overshootMm = trip.seq == l.seq ? toMm((Axis) lead, abs(currPos[lead] - trip.pos[lead])) : 0;
+  }
+  finishedUs[channels[c].line.seq & (FINISH_HISTORY - 1)] = micros() + engine.getLeadUs();
+  channels[c].active = false;
+  activeCount--;
+  lastChannel = c;
+  updateCompleted();
+}
+
+/** Parallel segments may finish out of order, 
+  * everything before the oldest running or queued segment is completed.
+  */
+void Motors::updateCompleted()
+{
+  Segment  *segment = queue.peek();
+  uint32_t  oldest  = segment ? segment->seq : startedSeq + 1;
+
+  for (int c = 0; c < MOTOR_CHANNELS; c++) {
+    if (channels[c].active && (int32_t) (channels[c].line.seq - oldest) < 0) {
+      oldest = channels[c].line.seq;
+    }
+  }
+  completedSeq = oldest - 1;
+}
+
+/** Plans the exit rate of a line backwards over the queued segments.
+  * The last queued segment has to stop, every segment before may be left as fast as 
+  * the junction allows and the following segment can still decelerate in time.
+  * Only a single running line followed by sequential segments is able to blend,
+  * otherwise the next segment has to wait for another channel and the line stops.
+  * Segments are never changed after they are queued, so only the consumer side is involved.
+  */
+void Motors::lookAhead(Channel &ch)
+{
+  uint32_t count    = 0;
+  uint32_t exitRate = 0;
+
+  if (activeCount == 1 && ch.line.stop.sensor < 0 && ch.line.total > 0) {
+    count = min(queue.count(), (uint32_t) LOOK_AHEAD);
+    for (uint32_t k = 0; k < count; k++) {
+      if (queue.peek(k)->parallel || queue.peek(k)->total == 0) {
+        count = k;
+        break;
+      }
+      if (queue.peek(k)->stop.sensor >= 0) {
+        count = k + 1;                         // Where a sensor move ends is unknown, it has to stop
+        break;
+      }
+    }
+  }
+  for (int k = (int) count - 1; k >= 0; k--) {
+    Segment    *next     = queue.peek(k);
+    Segment    *prev     = k > 0 ? queue.peek(k - 1) : NULL;
+    const long *steps    = prev ? prev->steps : ch.line.steps;
+    long        total    = prev ? prev->total : ch.line.total;
+    uint32_t    entryMax = Planner::maxEntryRate(lineLimits(next->steps, next->total), next->total, exitRate);
+    Junction    j        = Planner::junction(limits, steps, total, next->steps, next->total);
+
+    exitRate = min((uint64_t) j.maxRate, ((uint64_t) entryMax << FIX16_SHIFT) / j.ratio);
+  }
+  ch.line.exitRate = exitRate;
+  ch.line.planned  = count;
+  ch.seenQueued    = queue.count();
+  ch.seenActive    = activeCount;
 }
 
-void Motors::serialOut(byte value)
+/** Takes over the new sensor edges. The frames are rendered ahead of the output and the edge 
+  * is a bit older, so its step clock time is back by the engine's lead time and its age.
+  * The edge stops a sensor move and is handed over to the loop task with the position.
+  */
+void Motors::pollEdges()
+{
+  SensorEdge edge;
+
+  while (sensors && edgeIndex != sensors->getEdgeCount()) {
+    if (!sensors->getEdge(edgeIndex++, edge)) {
+      continue;
+    }
+
+    uint32_t    backUs = engine.getLeadUs() + (micros() - edge.us);
+    uint32_t    clock  = clockUs - backUs;
+    SensorEvent event;
+
+    event.edge = edge;
+    positionAt(clock, event.pos);
+
+    for (int c = 0; c < MOTOR_CHANNELS; c++) {
+      Line &l = channels[c].line;
+
+      if (channels[c].active && !l.stopping && 
+          l.stop.sensor == edge.channel && l.stop.rising == edge.rising &&
+          (int32_t) (clock - l.startUs) >= 0) {
+        SensorTrip &trip = trips[l.seq & (FINISH_HISTORY - 1)];
+
+        trip.seq = 0;
+        __sync_synchronize();
+        trip.us  = edge.us;
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+          trip.pos[axis] = event.pos[axis];
+        }
+        __sync_synchronize();
+        trip.seq   = l.seq;
+        tripLeadUs = backUs;
+        l.stopping = true;
+      }
+    }
+    if (eventHead - eventTail < SENSOR_EVENTS) {
+      events[eventHead & (SENSOR_EVENTS - 1)] = event;
+      __sync_synchronize();
+      eventHead++;
+    }
+  }
+}
+
+/** The position of all axes at the given step clock time. 
+  * Everything rendered after that time is taken back from the step history.
+  */
+void Motors::positionAt(uint32_t clock, long pos[AXIS_COUNT])
 {
-  digitalWrite(latchPin, LOW);                  // Schieberegister-Puffer sperren
-  shiftOut(dataPin, clockPin, MSBFIRST, value); // Wert über SPI senden
-  digitalWrite(latchPin, HIGH);                 // Schieberegister-Puffer freigeben
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    pos[axis] = currPos[axis];
+  }
+  for (uint32_t k = 1; k <= min(historyCount, (uint32_t) STEP_HISTORY); k++) {
+    const StepRecord &record = history[(historyCount - k) & (STEP_HISTORY - 1)];
+
+    if ((int32_t) (record.clockUs - clock) < 0) {
+      break;
+    }
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+      if (bitRead(record.steps, axis)) {
+        pos[axis] += bitRead(record.negative, axis) ? 1 : -1;
+      }
+    }
+  }
+}
+
+/** Motor task side of resetSteps(). */
+void Motors::handleAbort()
+{
+  uint32_t seq     = abortSeq;
+  Segment *segment = NULL;
+
+  for (int c = 0; c < MOTOR_CHANNELS; c++) {
+    Channel &ch = channels[c];
+
+    if (ch.active && (int32_t) (ch.line.seq - seq) <= 0) {
+      ch.active = false;
+      activeCount--;
+    }
+    ch.line.planned = 0;
+  }
+  while ((segment = queue.peek()) != NULL && (int32_t) (segment->seq - seq) <= 0) {
+    queue.pop();
+  }
+  if ((int32_t) (startedSeq - seq) < 0) {
+    startedSeq = seq;
+  }
+  updateCompleted();
+  engine.flush();
+  overshootMm  = 0;
+  abortRequest = false;
+}
+
+static uint32_t scale(uint32_t value, long total, long steps)
+{
+  return min((uint64_t) value * total / steps, (uint64_t) UINT32_MAX);
+}
+
+/** The limits of the leading axis. Each axis allows the leading axis to run faster by total / steps. */
+AxisLimits Motors::lineLimits(const long steps[AXIS_COUNT], long total)
+{
+  AxisLimits result = limits[AXIS_X];
+  bool       first  = true;
+
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    if (steps[axis] != 0) {
+      AxisLimits scaled = limits[axis];
+      long       n      = abs(steps[axis]);
+
+      scaled.startRate = scale(scaled.startRate, total, n);
+      scaled.maxRate   = scale(scaled.maxRate,   total, n);
+      scaled.accel     = scale(scaled.accel,     total, n);
+      scaled.jerk      = scale(scaled.jerk,      total, n);
+
+      result = first ? scaled : Planner::combine(result, scaled);
+      first  = false;
+    }
+  }
+  return result;
 }
 
 void Motors::setEnableBit(byte &value, short enableBit, bool enable)
@@ -90,35 +573,129 @@ void Motors::setEnableBit(byte &value, short enableBit, bool enable)
   }
 }
 
-void Motors::setBeepBit(byte &value, short beepBit, TickType_t startTickCount, long &beepMs)
+void Motors::setBeepBit(byte &value, short beepBit)
 {
-  uint32_t elapsedTimeMs = (xTaskGetTickCount() - startTickCount) * portTICK_PERIOD_MS;
-
-  if (elapsedTimeMs > beepMs) {
-    beepMs = 0;
-  }
-  if (beepMs > 0) {
+  if (!isIdleBeep()) {
     bitSet(value, beepBit);
   } else {
     bitClear(value, beepBit);
   }
 }
 
-void Motors::setStepperBit(byte &value, short dirBit, short stepBit, long &doSteps, long &pos)
+void Motors::setDirBits(byte &value, const Line &l)
 {
-  bitClear(value, stepBit);
-  if (doSteps != 0) {
-    bitSet(value, stepBit);
-    if (doSteps > 0) {
-      bitSet(value, dirBit);
-      doSteps--;
-      pos++;
-    } else {
-      bitClear(value, dirBit);
-      doSteps++;
-      pos--;
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    if (l.steps[axis] != 0 && (l.steps[axis] > 0) != invert[axis]) {
+      bitSet(value, dirBits[axis]);
+    }
+  }
+}
+
+/** One step of the leading axis, the other axes step if their Bresenham error overflows. */
+void Motors::setLineBits(byte &value, Line &l, StepRecord &record)
+{
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    long steps = l.steps[axis];
+
+    if (l.left[axis] > 0) {
+      l.error[axis] -= abs(steps);
+      if (l.error[axis] < 0) {
+        l.error[axis] += l.total;
+        l.left[axis]--;
+        currPos[axis] += steps > 0 ? 1 : -1;
+        bitSet(value, stepBits[axis]);
+        bitSet(record.steps, axis);
+        if (steps < 0) {
+          bitSet(record.negative, axis);
+        }
+      }
+    }
+  }
+  l.done++;
+}
+
+/** Renders the next step frame. Every channel runs on its own step clock, 
+  * channels which are due within one step period share the frame.
+  */
+/** A running line waits for a sensor edge. */
+bool Motors::isSensing()
+{
+  for (int c = 0; c < MOTOR_CHANNELS; c++) {
+    if (channels[c].active && channels[c].line.stop.sensor >= 0 && !channels[c].line.stopping) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Motors::stepChannels()
+{
+  StepRecord record     = { 0, 0, 0 };
+  byte       value      = 0b00000000;
+  uint32_t   minUs      = STEP_PULSE_US + STEP_PAUSE_US + max(delayUs, 0L);
+  int32_t    waitUs     = INT32_MAX;
+
+  setEnableBit(value, ENABLE_BIT, true);
+  setBeepBit(value, BEEP_BIT);
+  for (int c = 0; c < MOTOR_CHANNELS; c++) {
+    if (channels[c].active) {
+      setDirBits(value, channels[c].line);
+      waitUs = min(waitUs, (int32_t) (channels[c].dueUs - clockUs));
+    }
+  }
+  if (waitUs > 0) {
+    // Nothing due yet, e.g. a blended line continues with the interval of the previous one
+    engine.push(value, false, waitUs);
+    clockUs += waitUs;
+  }
+
+  for (int c = 0; c < MOTOR_CHANNELS; c++) {
+    Channel &ch = channels[c];
+
+    if (ch.active && (int32_t) (ch.dueUs - clockUs) < STEP_PULSE_US + STEP_PAUSE_US) {
+      if (ch.line.total == 0) {
+        finishLine(c);                         // Dwell is over
+        continue;
+      }
+      if (ch.seenActive != activeCount || 
+          (ch.seenQueued != queue.count() && ch.line.planned < LOOK_AHEAD)) {
+        lookAhead(ch);                         // New segments allow a faster exit
+      }
+
+      uint32_t intervalUs = ch.line.stopping ? ch.planner.next(0, 0) :
+                            ch.planner.next(ch.line.total - ch.line.done, ch.line.exitRate);
+
+      setLineBits(value, ch.line, record);
+      if ((int32_t) (ch.dueUs - clockUs) < 0) {
+        ch.dueUs = clockUs;                    // Late, don't try to catch up with a burst
+      }
+      ch.dueUs += max(intervalUs, minUs);
+      if (ch.line.done >= ch.line.total || (ch.line.stopping && ch.planner.atStartRate())) {
+        finishLine(c);
+      }
+    }
+  }
+
+  record.clockUs = clockUs;
+  history[historyCount++ & (STEP_HISTORY - 1)] = record;
+
+  engine.setStreaming(true);
+  engine.push(value, true, STEP_PULSE_US);
+  clockUs += STEP_PULSE_US;
+
+  bitClear(value, X_STEP_BIT);
+  bitClear(value, Y_STEP_BIT);
+  bitClear(value, Z_STEP_BIT);
+
+  waitUs = INT32_MAX;
+  for (int c = 0; c < MOTOR_CHANNELS; c++) {
+    if (channels[c].active) {
+      waitUs = min(waitUs, (int32_t) (channels[c].dueUs - clockUs));
     }
   }
+  waitUs = waitUs == INT32_MAX ? STEP_PAUSE_US : max(waitUs, (int32_t) STEP_PAUSE_US);
+  engine.push(value, false, waitUs);
+  clockUs += waitUs;
 }
 
 void Motors::motorTask(void *parg) 
@@ -126,42 +703,52 @@ void Motors::motorTask(void *parg)
   Motors *motors = (Motors *) parg;
 
   if (motors) {
-    TickType_t startTickCount = xTaskGetTickCount();
-
-    motors->serialOut(0b00000001);
+    motors->engine.begin(latchPin, clockPin, dataPin, motors->output);
+    if (motors->sensors) {
+      motors->sensors->setListener(xTaskGetCurrentTaskHandle());
+    }
     while (true) {
-      if ((!motors->enabled && motors->isIdleBeep()) || (motors->isIdleX() && motors->isIdleY() &&motors->isIdleZ())) {
-        if (motors->enabledOnIdle) {
-          motors->serialOut(0b00000000);
-        } else {
-          motors->serialOut(0b00000001);
-        }
-        vTaskDelay(pdMS_TO_TICKS(1));
-        startTickCount = xTaskGetTickCount();
-      } else {
-        byte value = 0b00000000;
+      if (motors->abortRequest) {
+        motors->handleAbort();
+      }
+      motors->pollEdges();
+      if (motors->enabled) {
+        motors->startLines();
+      }
+      if (motors->activeCount == 0) {
+        byte       value = motors->enabledOnIdle ? 0b00000000 : 0b00000001;
+        TickType_t wait  = portMAX_DELAY;
+        int32_t    idle  = 0;
 
-        motors->setEnableBit(value, ENABLE_BIT, motors->enabled);
-        if (motors->enabled) {
-          motors->setStepperBit(value, X_DIR_BIT, X_STEP_BIT, motors->doStepsX, motors->currPosX);
-          motors->setStepperBit(value, Y_DIR_BIT, Y_STEP_BIT, motors->doStepsY, motors->currPosY);
-          motors->setStepperBit(value, Z_DIR_BIT, Z_STEP_BIT, motors->doStepsZ, motors->currPosZ);
+        if (!motors->wokenFromIdle) {
+          motors->idleUs = micros() + motors->engine.getLeadUs();
         }
-        motors->setBeepBit(value, BEEP_BIT, startTickCount, motors->beepMs);
-
-        motors->serialOut(value);
-        ets_delay_us(10);
-
-        bitClear(value, X_STEP_BIT);
-        bitClear(value, Y_STEP_BIT);
-        bitClear(value, Z_STEP_BIT);
+        motors->engine.setStreaming(false);
+        motors->setBeepBit(value, BEEP_BIT);
+        motors->engine.setIdleValue(value);
 
-        motors->serialOut(value);
-        ets_delay_us(100);
+        if (!motors->isIdleBeep()) {
+          wait = max(motors->beepUntil - xTaskGetTickCount(), (TickType_t) 1);
+        }
+        // Sleep until a segment, a beep, a sensor edge or a state change is posted
+        ulTaskNotifyTake(pdTRUE, wait);
+        motors->idleWakeups++;
+        motors->wokenFromIdle = true;
 
-        if (motors->delayUs > 0) {
-          ets_delay_us(motors->delayUs);
+        // Keep the step clock running with the time, the edges are timed by it
+        idle = micros() - motors->idleUs;
+        if (idle > 0) {
+          motors->clockUs += idle;
+          motors->idleUs  += idle;
         }
+      } else if (motors->engine.space() < 3) {
+        // Buffer full, sleep until the timer interrupt has shifted out half of it
+        motors->engine.waitForSpace();
+      } else if (motors->isSensing() && motors->engine.isAhead(SENSOR_AHEAD_FRAMES, SENSOR_AHEAD_US)) {
+        // Stay close to the output, the deceleration starts after the frames already rendered
+        motors->engine.waitForSpace(STEP_FRAME_COUNT - SENSOR_AHEAD_FRAMES / 2);
+      } else {
+        motors->stepChannels();
       }
     }
   }
@@ -169,9 +756,5 @@ void Motors::motorTask(void *parg)
 
 void Motors::begin()
 {
-  pinMode(latchPin, OUTPUT);
-  pinMode(clockPin, OUTPUT);
-  pinMode(dataPin, OUTPUT);
-
-  xTaskCreatePinnedToCore(motorTask, "motorTask", 10000, this, 1, nullptr, 0);
+  xTaskCreatePinnedToCore(motorTask, "motorTask", 10000, this, 1, &taskHandle, 0);
 }
@@ -20,35 +20,181 @@
   * @file Motors.h
   * 
   * Stepper Interface
+  *
+  * A sensor edge is seen on the rendered frames, so while a line with a sensor stop runs only
+  * SENSOR_AHEAD_FRAMES (timer) or SENSOR_AHEAD_US (I2S) are rendered ahead. Worst case before the
+  * deceleration starts, at 24000 steps/s and 38.5 steps/mm: the 2 ms adc frame and the debounce
+  * (1.5 mm) plus the frames ahead, 0.2 mm with the timer or 1.3 mm with I2S. The ramp down to the
+  * start rate comes on top of that, it is measured and taken off the next feed.
   */
 
+#include "StepEngine.h"
+#include "Planner.h"
+#include "SegmentQueue.h"
+#include "Sensors.h"
+
+#define STEP_PULSE_US  10                      //!< Length of the step pulse
+#define STEP_PAUSE_US  10                      //!< Minimum pause between two step pulses
+#define LOOK_AHEAD     16                      //!< Maximum number of queued segments to plan the exit rate
+#define MOTOR_CHANNELS AXIS_COUNT              //!< Independent moves at the same time, at most one per axis
+#define STEP_HISTORY   512                     //!< Rendered step frames kept to find the position at a sensor edge (power of two)
+#define SENSOR_EVENTS  16                      //!< Sensor edges with position for the loop task (power of two)
+#define FINISH_HISTORY 64                      //!< Start and finish times kept per sequence number (power of two)
+#define SENSOR_AHEAD_FRAMES 16                 //!< Frames rendered ahead of the timer output during a sensor stop line
+#define SENSOR_AHEAD_US     2000               //!< Time rendered ahead of the I2S output during a sensor stop line
+
+/**
+  * Calibration and limits of one axis.
+  */
+struct AxisConfig
+{
+  fix16_t    stepsPerMm;
+  bool       invert;                           //!< Direction pin is inverted
+  AxisLimits limits;
+};
+
+/**
+  * Coordinated move of all axes. The axis with the most steps leads,
+  * the others follow with a Bresenham interpolation.
+  */
+struct Line
+{
+  long     steps[AXIS_COUNT];                  //!< Signed steps per axis
+  long     left [AXIS_COUNT];                  //!< Steps per axis still to do
+  long     error[AXIS_COUNT];                  //!< Bresenham error terms
+  long     total;                              //!< Steps of the leading axis
+  long     done;                               //!< Steps of the leading axis already done
+  uint8_t  axes;                               //!< Bit mask of the axes that move
+  bool     parallel;                           //!< Other parallel lines may run beside it
+  uint32_t seq;                                //!< Sequence number of the segment
+  uint32_t exitRate;                           //!< Rate of the leading axis at the end, from the look-ahead
+  uint32_t planned;                            //!< Number of queued segments the exit rate is based on
+  SensorStop stop;
+  bool     stopping;                           //!< Sensor tripped, decelerating to the start rate
+  uint32_t startUs;                            //!< Step clock time of the first step
+};
+
+/**
+  * Sensor edge with the position of all axes at that time.
+  */
+struct SensorEvent
+{
+  SensorEdge edge;
+  long       pos[AXIS_COUNT];
+};
+
+/**
+  * Where the sensor of a segment stopped it.
+  */
+struct SensorTrip
+{
+  uint32_t seq;                                //!< Sequence number of the segment
+  uint32_t us;                                 //!< micros() of the sensor edge
+  long     pos[AXIS_COUNT];                    //!< Output position at the edge
+};
+
+/**
+  * One rendered step frame, the step clock time and the axes that stepped.
+  */
+struct StepRecord
+{
+  uint32_t clockUs;
+  uint8_t  steps;                              //!< Bit per axis
+  uint8_t  negative;                           //!< Bit per axis stepping backwards
+};
+
+/**
+  * One line with its own profile and its own step clock.
+  */
+struct Channel
+{
+  Line     line;
+  Planner  planner;
+  bool     active;
+  uint32_t dueUs;                              //!< Step clock time of the next step
+  uint32_t seenQueued;                         //!< Queue count the look-ahead was based on
+  int      seenActive;                         //!< Active channels the look-ahead was based on
+};
+
 class Motors
 {
 private:
-  bool enabled;
-  bool enabledOnIdle;
-  long currPosX;
-  long currPosY;
-  long currPosZ;
-  long doStepsX;
-  long doStepsY;
-  long doStepsZ;
-  long delayUs;
-  long beepMs;
+  StepEngine         engine;
+  StepEngine::Output output;
+  AxisLimits         limits    [AXIS_COUNT];
+  fix16_t            stepsPerMm[AXIS_COUNT];
+  bool               invert    [AXIS_COUNT];
+
+  SegmentQueue       queue;
+  uint32_t           pushedSeq;                //!< Last sequence number pushed by the loop task
+  uint32_t           startedSeq;               //!< Last sequence number taken over by the motor task
+  volatile uint32_t  completedSeq;             //!< All sequence numbers up to this one are finished
+  volatile uint32_t  abortSeq;                 //!< Drop all segments up to this sequence number
+  volatile bool      abortRequest;
+
+  Channel            channels[MOTOR_CHANNELS];
+  int                activeCount;
+  int                lastChannel;              //!< Channel that finished last, a following segment may blend in
+  uint32_t           clockUs;                  //!< Step clock, time of the next frame pushed to the engine
+
+  Sensors           *sensors;
+  StepRecord         history[STEP_HISTORY];
+  uint32_t           historyCount;
+  SensorTrip         trips[FINISH_HISTORY];    //!< Per sequence number, written by the motor task only
+  uint32_t           tripLeadUs;               //!< Rendered ahead of the tripping sensor edge
+  fix16_t            overshootMm;              //!< How far the last sensor move ran past its edge
+  uint32_t           edgeIndex;                //!< Next sensor edge to take over
+  SensorEvent        events[SENSOR_EVENTS];
+  volatile uint32_t  eventHead;                //!< Written by the motor task only
+  volatile uint32_t  eventTail;                //!< Written by the loop task only
+  uint32_t           idleUs;                   //!< micros() at which the output of the step clock stopped
+  uint32_t           startedUs [FINISH_HISTORY];  //!< micros() at which a segment is started, before its dwell time
+  uint32_t           finishedUs[FINISH_HISTORY];  //!< micros() at which the last step of a segment is output
+
+  TaskHandle_t       taskHandle;
+  bool               wokenFromIdle;
+  volatile uint32_t  idleWakeups;
+  volatile uint32_t  startLatencyUs;           //!< Time from queueing to the first step of the last start from idle
+  volatile uint32_t  maxStartLatencyUs;
+
+  bool       enabled;
+  bool       enabledOnIdle;
+  long       currPos[AXIS_COUNT];
+  long       endPos [AXIS_COUNT];              //!< Position after all pushed segments, loop task only
+  bool       endStale;                         //!< Dropped segments are still counted in endPos
+  long       delayUs;
+  TickType_t beepUntil;
 
 private:
   static void motorTask(void *parg);
 
 private:
-  void serialOut     (byte value);
+  void notify        ();
   void setEnableBit  (byte &value, short enableBit, bool enable);
-  void setBeepBit    (byte &value, short beepBit, TickType_t startTickCount, long &beepMs);
-  void setStepperBit (byte &value, short dirBit, short stepBit, long &doSteps, long &pos);
+  void setBeepBit    (byte &value, short beepBit);
+  void setDirBits    (byte &value, const Line &l);
+  void setLineBits   (byte &value, Line &l, StepRecord &record);
+
+  void       initLine       (Line &l, const Segment &segment);
+  void       startLines     ();
+  void       finishLine     (int c);
+  void       updateCompleted();
+  void       stepChannels   ();
+  bool       isSensing      ();
+  void       handleAbort    ();
+  void       lookAhead      (Channel &ch);
+  void       pollEdges      ();
+  void       positionAt     (uint32_t clock, long pos[AXIS_COUNT]);
+  void       shortenByTrip  (Segment &segment);
+  void       syncEnd        ();
+  AxisLimits lineLimits     (const long steps[AXIS_COUNT], long total);
 
 public:
   Motors();
 
   void begin();
+  void setOutput(StepEngine::Output out) { output = out; }
+  void setSensors(Sensors *s)            { sensors = s;  }
 
   void reset();
   void resetSteps();
@@ -56,22 +202,51 @@ public:
   void enable(bool en);
   bool isEnabled()           { return enabled;       }
 
-  bool isIdle()              { return isIdleX() && isIdleY() && isIdleZ(); }
-  bool isIdleX()             { return doStepsX == 0; }
-  bool isIdleY()             { return doStepsY == 0; }
-  bool isIdleZ()             { return doStepsZ == 0; }
-  bool isIdleBeep()          { return beepMs   == 0; }
+  bool isIdle()              { return isDone(pushedSeq) && engine.isEmpty(); }
+  bool isDone(uint32_t seq)  { return (int32_t) (completedSeq - seq) >= 0; }
+  bool isIdleBeep()          { return (int32_t) (xTaskGetTickCount() - beepUntil) >= 0; }
+
+  void enableOnIdle(bool en) { enabledOnIdle = en; notify(); }
+
+  long getPosX()             { return currPos[AXIS_X]; }
+  long getPosY()             { return currPos[AXIS_Y]; }
+  long getPosZ()             { return currPos[AXIS_Z]; }
+  long getPos(Axis axis)     { return currPos[axis];   }
+  long getEndPos(Axis axis)  { syncEnd(); return endPos[axis]; }
+  void stepX(int steps)      { move(steps, 0, 0, true); }
+  void stepY(int steps)      { move(0, steps, 0, true); }
+  void stepZ(int steps)      { move(0, 0, steps, true); }
+
+  uint32_t move     (long x, long y, long z, bool parallel = false);
+  uint32_t moveUntil(long x, long y, long z, const SensorStop &stop);
+  uint32_t push     (const Segment &segment);
+  uint32_t getQueueSpace()   { return SEGMENT_QUEUE_SIZE - queue.count(); }
+
+  static Segment makeSegment(long x, long y, long z, bool parallel, const SensorStop &stop, uint32_t dwellUs = 0);
+  bool     getTrip  (uint32_t seq, SensorTrip &trip);
+  uint32_t getTripLeadUs()   { return tripLeadUs;    }
+  bool     getEvent (SensorEvent &event);
+  uint32_t getPushedSeq()    { return pushedSeq;     }
+  uint32_t getCompletedSeq() { return completedSeq;  }
+  uint32_t getStartedUs (uint32_t seq)  { return startedUs [seq & (FINISH_HISTORY - 1)]; }
+  uint32_t getFinishedUs(uint32_t seq)  { return finishedUs[seq & (FINISH_HISTORY - 1)]; }
 
-  void enableOnIdle(bool en) { enabledOnIdle = en;   }
+  void delay(int us)         { delayUs = us;         }
 
-  long getPosX()             { return currPosX;      }
-  long getPosY()             { return currPosY;      }
-  long getPosZ()             { return currPosZ;      }
-  void stepX(int steps)      { if (enabled) doStepsX += steps; }
-  void stepY(int steps)      { if (enabled) doStepsY += steps; }
-  void stepZ(int steps)      { if (enabled) doStepsZ += steps; }
+  void       setAxis(Axis axis, const AxisConfig &config);
+  AxisConfig getAxis(Axis axis);
+  void       setLimits(Axis axis, const AxisLimits &l) { limits[axis] = l; }
 
-  void delay(int us)         { delayUs = us;         }
+  long    toSteps(Axis axis, fix16_t mm)  { return ((int64_t) mm * stepsPerMm[axis] + ((int64_t) 1 << 31)) >> 32;  }
+  fix16_t toMm   (Axis axis, long steps)  { return ((int64_t) steps << 32) / stepsPerMm[axis];                   }
+
+  void beep(int ms)          { beepUntil = xTaskGetTickCount() + pdMS_TO_TICKS(ms); notify(); }
+
+  uint32_t getMaxStepRate()  { return engine.getMaxStepRate(); }
+  uint32_t getMaxJitterUs()  { return engine.getMaxJitterUs(); }
+  uint32_t getUnderruns()    { return engine.getUnderruns();   }
 
-  void beep(int ms)          { beepMs = ms;          }
+  uint32_t getIdleWakeups()        { return idleWakeups;       }
+  uint32_t getStartLatencyUs()     { return startLatencyUs;    }
+  uint32_t getMaxStartLatencyUs()  { return maxStartLatencyUs; }
 };
@@ -0,0 +1,209 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Planner.cpp
+  *
+  * Acceleration planner.
+  */
+
+#include "Planner.h"
+
+#define ACCEL_SHIFT    26
+#define JERK_SHIFT     20
+
+// Steps/s^2 to Q16.16 rate change per us << 8: accel * 2^24 / 10^6
+static constexpr uint64_t ACCEL_TO_Q = (((uint64_t) 1 << (24 + ACCEL_SHIFT)) + US_PER_S / 2) / US_PER_S;
+// Steps/s^3 to acceleration change per us << 16: jerk * 2^40 / 10^12
+static constexpr uint64_t JERK_TO_Q  = (((uint64_t) 1 << (40 + JERK_SHIFT)) + US_PER_S * US_PER_S / 2) / ((uint64_t) US_PER_S * US_PER_S);
+// Interval in 1/16 us from the rate in Q16.8
+static constexpr uint32_t US_Q4      = US_PER_S << 12;
+
+Planner::Planner()
+  : rate(0)
+  , accel(0)
+  , decelerating(false)
+{
+  AxisLimits l = { 1000, 1000, 0, 0 };
+
+  setLimits(l);
+}
+
+/** Starts a new move with the rate the motors are already running. */
+void Planner::start(const AxisLimits &l, uint32_t entryRate)
+{
+  setLimits(l);
+  rate         = constrain(min(entryRate, (uint32_t) PLANNER_MAX_RATE) << FIX16_SHIFT, startQ, maxQ);
+  accel        = 0;
+  decelerating = false;
+}
+
+/** Changes the limits during a move, e.g. if another axis joins in. 
+  * All conversions to the fixed point units happen here, once per move.
+  */
+void Planner::setLimits(const AxisLimits &l)
+{
+  limits         = l;
+  limits.maxRate = constrain(limits.maxRate, (uint32_t) 1, (uint32_t) PLANNER_MAX_RATE);
+  limits.startRate = constrain(limits.startRate, (uint32_t) 1, limits.maxRate);
+
+  startQ   = limits.startRate << FIX16_SHIFT;
+  maxQ     = limits.maxRate   << FIX16_SHIFT;
+  maxAccel = min((limits.accel * ACCEL_TO_Q) >> ACCEL_SHIFT, (uint64_t) INT32_MAX);
+  maxJerk  = min((limits.jerk  * JERK_TO_Q)  >> JERK_SHIFT,  (uint64_t) INT32_MAX);
+  invJerk  = maxJerk > 0 ? ((uint64_t) 1 << 32) / maxJerk : 0;
+  rate     = constrain(rate, startQ, maxQ);
+}
+
+/** True if the steps to get from the current rate down to the exit rate are not more than remaining.
+  * With a jerk limit the acceleration first has to be turned around to -accel in the time t,
+  * the ramp out at the end is not needed because the exit rate is a start/stop rate.
+  * The rest is compared as 2 * accel * steps <= v^2 - exit^2, so no division is needed.
+  */
+bool Planner::mustStop(long remaining, uint32_t exitRate)
+{
+  int64_t v    = rate;
+  long    left = remaining - 1;
+  
+  exitRate = max(min(exitRate, (uint32_t) PLANNER_MAX_RATE) << FIX16_SHIFT, startQ);
+
+  if (maxJerk > 0) {
+    uint32_t tUs  = ((uint64_t) (accel + maxAccel) * invJerk) >> 16;
+    int64_t  vMid = v + ((((2 * (int64_t) accel - maxAccel) * tUs) >> 8) * 10923 >> 16);   // v + (2a - A) t / 6
+
+    // Turnaround steps t * (v + a t / 2 - J t^2 / 6), the rate at its end v + (a - A) t / 2
+    left -= (long) (((uint64_t) max(vMid >> 8, (int64_t) 0) * tUs * US_RECIP_32) >> 40);
+    v    += ((int64_t) (accel - maxAccel) * tUs) >> 9;
+  }
+  if (left <= 0) {
+    return true;
+  }
+  if (v <= (int64_t) exitRate) {
+    return false;
+  }
+
+  uint64_t vi = v        >> FIX16_SHIFT;
+  uint64_t ei = exitRate >> FIX16_SHIFT;
+
+  return (uint64_t) left * 2 * limits.accel <= vi * vi - ei * ei;
+}
+
+/** Returns the interval in us until the following step and advances the profile by one step. */
+uint32_t Planner::next(long remaining, uint32_t exitRate)
+{
+  if (maxAccel <= 0) {
+    rate = maxQ;
+    return US_PER_S / limits.maxRate;
+  }
+
+  int32_t  target = 0;
+  uint32_t dtQ4   = US_Q4 / (rate >> 8);        // The only division per step
+
+  if (mustStop(remaining, exitRate)) {
+    target       = -maxAccel;
+    decelerating = true;
+  } else if (decelerating) {
+    target = 0;                                  // Never accelerate again, just wait for the ramp down
+  } else if (rate < maxQ) {
+    target = maxAccel;
+    if (maxJerk > 0 && (uint64_t) ((maxQ - rate) >> 8) * 2 * maxJerk <= (uint64_t) ((int64_t) accel * accel)) {
+      target = 0;                                // Ease into the cruise rate: maxRate - rate <= accel^2 / (2 jerk)
+    }
+  }
+
+  if (maxJerk > 0) {
+    int32_t da = ((int64_t) maxJerk * dtQ4) >> 20;
+
+    accel = target > accel ? min(accel + da, target) : max(accel - da, target);
+  } else {
+    accel = target;
+  }
+
+  rate = constrain((int64_t) rate + (((int64_t) accel * dtQ4) >> 12), (int64_t) startQ, (int64_t) maxQ);
+  return (dtQ4 + 8) >> 4;
+}
+
+/** Smaller of two limits where 0 means unlimited. */
+static uint32_t minLimit(uint32_t a, uint32_t b)
+{
+  return a == 0 ? b : (b == 0 ? a : min(a, b));
+}
+
+/** Limits for a move of both axes together. */
+AxisLimits Planner::combine(const AxisLimits &a, const AxisLimits &b)
+{
+  AxisLimits l;
+
+  l.maxRate   = min(a.maxRate, b.maxRate);
+  l.startRate = min(min(a.startRate, b.startRate), l.maxRate);
+  l.accel     = minLimit(a.accel, b.accel);
+  l.jerk      = minLimit(a.jerk,  b.jerk);
+  return l;
+}
+
+/** Highest rate a move can be entered with and still reach the exit rate at its end. */
+uint32_t Planner::maxEntryRate(const AxisLimits &l, long steps, uint32_t exitRate)
+{
+  if (l.accel == 0) {
+    return l.maxRate;
+  }
+
+  uint64_t exit2 = (uint64_t) exitRate * exitRate;
+  uint32_t rate  = isqrt(exit2 + (uint64_t) 2 * l.accel * steps);
+
+  if (l.jerk > 0) {
+    int64_t effective = steps - (int64_t) ((uint64_t) rate * l.accel / l.jerk);  // Part of the move needed to turn the acceleration
+
+    rate = effective > 0 ? isqrt(exit2 + (uint64_t) 2 * l.accel * effective) : exitRate;
+  }
+  return min(rate, l.maxRate);
+}
+
+/** The axis with the biggest common velocity in both moves keeps its rate, 
+  * every other axis may change its rate at most by its start rate.
+  * Velocities are the axis steps per step of the leading axis in Q16.16.
+  */
+Junction Planner::junction(const AxisLimits limits[AXIS_COUNT], 
+                           const long stepsA[AXIS_COUNT], long totalA,
+                           const long stepsB[AXIS_COUNT], long totalB)
+{
+  Junction j    = { FIX16_ONE, UINT32_MAX };
+  fix16_t  a[AXIS_COUNT];
+  fix16_t  b[AXIS_COUNT];
+  fix16_t  best = 0;
+
+  if (totalA <= 0 || totalB <= 0) {
+    j.maxRate = 0;
+    return j;
+  }
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    a[axis] = ((int64_t) stepsA[axis] << FIX16_SHIFT) / totalA;
+    b[axis] = ((int64_t) stepsB[axis] << FIX16_SHIFT) / totalB;
+
+    if ((int64_t) a[axis] * b[axis] > 0 && abs(b[axis]) > best) {
+      best    = abs(b[axis]);
+      j.ratio = constrain(((int64_t) a[axis] << FIX16_SHIFT) / b[axis], (int64_t) 1, (int64_t) INT32_MAX);
+    }
+  }
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    int64_t jump = abs(a[axis] - fix16Mul(j.ratio, b[axis]));
+
+    if (jump > FIX16_ONE / 1000) {
+      j.maxRate = min(j.maxRate, (uint32_t) (((uint64_t) limits[axis].startRate << FIX16_SHIFT) / jump));
+    }
+  }
+  return j;
+}
@@ -0,0 +1,91 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file Planner.h
+  *
+  * Acceleration planner. Produces the interval to the next step so that a
+  * move starts slow, cruises at the maximum rate and decelerates into the target.
+  * With a jerk limit the acceleration itself is ramped (S-curve), without it
+  * the profile is a plain trapezoid.
+  * The per step math is integer only: the rate is kept in Q16.16 steps/s,
+  * the acceleration and the jerk are scaled to rate changes per microsecond.
+  */
+
+#include <Arduino.h>
+#include "Fixed.h"
+
+#define PLANNER_MAX_RATE  65535                //!< Q16.16 limit, above the 50000 steps/s the pulse timing allows
+
+enum Axis {
+  AXIS_X, AXIS_Y, AXIS_Z, AXIS_COUNT
+};
+
+/**
+  * Speed limits of one axis, all values in steps.
+  */
+struct AxisLimits
+{
+  uint32_t startRate;   //!< Steps/s the axis can start and stop without a ramp
+  uint32_t maxRate;     //!< Maximum steps/s
+  uint32_t accel;       //!< Steps/s^2, 0 to jump to the maximum rate without a ramp
+  uint32_t jerk;        //!< Steps/s^3, 0 for a trapezoid profile
+};
+
+/**
+  * Transition between two coordinated moves. The rates are those of the leading axes.
+  */
+struct Junction
+{
+  fix16_t  ratio;       //!< Entry rate of the next move = exit rate of this move * ratio
+  uint32_t maxRate;     //!< Highest exit rate at which no axis jumps more than its start rate
+};
+
+class Planner
+{
+private:
+  AxisLimits limits;
+  uint32_t   startQ;    //!< limits.startRate in Q16.16
+  uint32_t   maxQ;      //!< limits.maxRate in Q16.16
+  int32_t    maxAccel;  //!< limits.accel as Q16.16 rate change per us << 8
+  int32_t    maxJerk;   //!< limits.jerk as acceleration change per us << 16
+  uint64_t   invJerk;   //!< 2^32 / maxJerk
+  uint32_t   rate;      //!< Current steps/s, Q16.16
+  int32_t    accel;     //!< Current acceleration, same unit as maxAccel
+  bool       decelerating;
+
+private:
+  bool mustStop(long remaining, uint32_t exitRate);
+
+public:
+  Planner();
+
+  void     start     (const AxisLimits &l, uint32_t entryRate);
+  void     setLimits (const AxisLimits &l);
+
+  uint32_t next      (long remaining, uint32_t exitRate);
+
+  uint32_t getRate()                    { return rate >> FIX16_SHIFT; }
+  bool     atStartRate()                { return rate <= startQ;      }
+
+  static AxisLimits combine      (const AxisLimits &a, const AxisLimits &b);
+  static uint32_t   maxEntryRate (const AxisLimits &l, long steps, uint32_t exitRate);
+  static Junction   junction     (const AxisLimits limits[AXIS_COUNT], 
+                                  const long stepsA[AXIS_COUNT], long totalA,
+                                  const long stepsB[AXIS_COUNT], long totalB);
+};
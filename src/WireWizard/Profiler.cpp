@@ -0,0 +1,179 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Profiler.cpp
+  *
+  * Cycle time statistics.
+  */
+
+#include "Profiler.h"
+#include "Config.h"
+
+static portMUX_TYPE profilerMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *phaseNames[JOB_PHASES] = { 
+  "wait", "feed", "sense", "strip", "cut", "retract", "eject", "dwell" 
+};
+
+RollingStats::RollingStats()
+{
+  clear();
+}
+
+void RollingStats::clear()
+{
+  count = 0;
+  sum   = 0;
+}
+
+void RollingStats::add(uint32_t us)
+{
+  uint32_t &slot = samples[count & (PROFILE_WINDOW - 1)];
+
+  if (count >= PROFILE_WINDOW) {
+    sum -= slot;
+  }
+  slot  = us;
+  sum  += us;
+  count++;
+}
+
+/** The p95 is taken from a sorted copy of the window. */
+void RollingStats::get(ProfileSummary &summary)
+{
+  uint32_t sorted[PROFILE_WINDOW];
+  uint32_t n = min(count, (uint32_t) PROFILE_WINDOW);
+
+  for (uint32_t k = 0; k < n; k++) {
+    uint32_t us = samples[k];
+    uint32_t j  = k;
+
+    for (; j > 0 && sorted[j - 1] > us; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = us;
+  }
+  summary.count  = n;
+  summary.minUs  = n > 0 ? sorted[0]                  : 0;
+  summary.meanUs = n > 0 ? sum / n                    : 0;
+  summary.p95Us  = n > 0 ? sorted[(n * 95 - 1) / 100] : 0;
+  summary.maxUs  = n > 0 ? sorted[n - 1]              : 0;
+}
+
+/* ******************************************** */
+
+/** Constructor */
+Profiler::Profiler(Motors &m)
+  : motors(m)
+{
+}
+
+void Profiler::clear()
+{
+  portENTER_CRITICAL(&profilerMux);
+  for (int p = 0; p < JOB_PHASES; p++) {
+    phases[p].clear();
+  }
+  cycle.clear();
+  portEXIT_CRITICAL(&profilerMux);
+}
+
+/** A finished piece of a job. Phases the recipe doesn't use are left out. */
+void Profiler::addPiece(const uint32_t spent[JOB_PHASES], uint32_t cycleUs)
+{
+  portENTER_CRITICAL(&profilerMux);
+  for (int p = 0; p < JOB_PHASES; p++) {
+    if (spent[p] > 0 || p == JOB_WAIT) {
+      phases[p].add(spent[p]);
+    }
+  }
+  cycle.add(cycleUs);
+  portEXIT_CRITICAL(&profilerMux);
+}
+
+/** Copies the window and sorts it outside the critical section, as getCycle() does. */
+ProfileSummary Profiler::getPhase(JobPhase p)
+{
+  ProfileSummary summary;
+  RollingStats   stats;
+
+  portENTER_CRITICAL(&profilerMux);
+  stats = phases[p];
+  portEXIT_CRITICAL(&profilerMux);
+  stats.get(summary);
+  return summary;
+}
+
+ProfileSummary Profiler::getCycle()
+{
+  ProfileSummary summary;
+  RollingStats   stats;
+
+  portENTER_CRITICAL(&profilerMux);
+  stats = cycle;
+  portEXIT_CRITICAL(&profilerMux);
+  stats.get(summary);
+  return summary;
+}
+
+/** Throughput over the pieces in the window. */
+uint32_t Profiler::getPiecesPerHour()
+{
+  ProfileSummary summary = getCycle();
+
+  return summary.meanUs > 0 ? (uint64_t) 3600 * US_PER_S / summary.meanUs : 0;
+}
+
+static String column(uint32_t value, unsigned int width)
+{
+  String text = String(value);
+
+  while (text.length() < width) {
+    text = " " + text;
+  }
+  return text;
+}
+
+static String reportLine(const char *name, const ProfileSummary &summary)
+{
+  String line = name;
+
+  while (line.length() < 8) {
+    line += " ";
+  }
+  return line + column(summary.count, 4) + column(summary.minUs, 10) + column(summary.meanUs, 10) + 
+         column(summary.p95Us, 10) + column(summary.maxUs, 10) + "\n";
+}
+
+/** Table of all statistics in us, used for the serial and the http output. */
+String Profiler::report()
+{
+  String text = (String) "Cycle time (last " + PROFILE_WINDOW + " samples, us), " + getPiecesPerHour() + " pieces/h\n" + 
+                "           n       min      mean       p95       max\n";
+
+  for (int p = 0; p < JOB_PHASES; p++) {
+    ProfileSummary summary = getPhase((JobPhase) p);
+
+    if (summary.count > 0) {
+      text += reportLine(phaseNames[p], summary);
+    }
+  }
+  text += reportLine("cycle", getCycle());
+  text += (String) "Step engine: " + motors.getMaxStepRate() + " steps/s, jitter " + motors.getMaxJitterUs() + " us, underruns " + motors.getUnderruns() + "\n";
+  text += (String) "Motor task: " + motors.getIdleWakeups() + " idle wakeups, start latency " + motors.getStartLatencyUs() + " us (max " + motors.getMaxStartLatencyUs() + " us)\n";
+  return text;
+}
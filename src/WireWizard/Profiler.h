@@ -0,0 +1,82 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file Profiler.h
+  *
+  * Cycle time statistics. Every piece of a job adds the time spent per phase,
+  * taken from the start and finish times of its segments in the motor task.
+  * Each statistic keeps a rolling window of the last samples and gives
+  * min, mean, p95 and max of it. The report adds the peaks of the step engine
+  * and of the motor task.
+  */
+
+#include <Arduino.h>
+#include "Recipe.h"
+
+#define PROFILE_WINDOW 64                      //!< Samples per statistic (power of two)
+
+/**
+  * Summary of the samples in the window, all times in us.
+  */
+struct ProfileSummary
+{
+  uint32_t count;                              //!< Samples in the window
+  uint32_t minUs;
+  uint32_t meanUs;
+  uint32_t p95Us;
+  uint32_t maxUs;
+};
+
+/**
+  * Rolling window of time samples.
+  */
+class RollingStats
+{
+private:
+  uint32_t samples[PROFILE_WINDOW];
+  uint32_t count;                              //!< Samples added since the clear
+  uint64_t sum;                                //!< Of the samples in the window
+
+public:
+  RollingStats();
+
+  void clear();
+  void add  (uint32_t us);
+  void get  (ProfileSummary &summary);
+};
+
+class Profiler
+{
+private:
+  Motors      &motors;
+  RollingStats phases[JOB_PHASES];
+  RollingStats cycle;
+
+public:
+  Profiler(Motors &m);
+
+  void clear   ();
+  void addPiece(const uint32_t spent[JOB_PHASES], uint32_t cycleUs);
+
+  ProfileSummary getPhase(JobPhase p);
+  ProfileSummary getCycle();
+  uint32_t       getPiecesPerHour();
+
+  String report();
+};
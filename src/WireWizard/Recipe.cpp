@@ -0,0 +1,302 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Recipe.cpp
+  *
+  * Cut recipes.
+  */
+
+#include "Recipe.h"
+#include "Config.h"
+
+static const char *opNames[RECIPE_OPS] = {
+  "feed", "feedrest", "feedto", "strip", "cut", "eject", "dwell"
+};
+
+Recipe::Recipe()
+  : count(0)
+{
+  setDefault();
+}
+
+/** The plain recipe: feed the piece, cut and eject it. */
+void Recipe::setDefault()
+{
+  clear();
+  add(RECIPE_FEED_REST);
+  add(RECIPE_CUT);
+  add(RECIPE_EJECT);
+}
+
+bool Recipe::add(RecipeOp op, int32_t arg)
+{
+  if (count >= RECIPE_STEPS || arg < 0 || (op == RECIPE_DWELL && arg > RECIPE_DWELL_MS)) {
+    return false;
+  }
+  steps[count].op  = op;
+  steps[count].arg = arg;
+  count++;
+  return true;
+}
+
+/** One step per line or separated by ';', the name and the argument if it has one. 
+  * Lengths are given in mm, the strip stroke in steps and the dwell in ms.
+  * The recipe stays as it is if a step is wrong.
+  */
+bool Recipe::parse(const char *text)
+{
+  Recipe parsed;
+
+  parsed.clear();
+  while (*text) {
+    char line[32];
+    char name[16];
+    char arg [16];
+    int  used = 0;
+
+    for (; *text && *text != '\n' && *text != ';'; text++) {
+      if (used < (int) sizeof(line) - 1) {
+        line[used++] = *text;
+      }
+    }
+    if (*text) {
+      text++;
+    }
+    line[used] = 0;
+    arg[0]     = 0;
+    if (sscanf(line, "%15s %15s", name, arg) < 1) {
+      continue;                                // Empty line
+    }
+
+    int      op    = 0;
+    fix16_t  mm    = 0;
+    uint32_t value = 0;
+    char    *end   = arg;
+
+    while (op < RECIPE_OPS && strcmp(name, opNames[op]) != 0) {
+      op++;
+    }
+    switch (op) {
+    case RECIPE_FEED:
+    case RECIPE_FEED_TO:
+    case RECIPE_EJECT:
+      if (!(arg[0] == 0 && op == RECIPE_EJECT) && (!fix16Parse(arg, mm) || mm <= 0)) {
+        return false;
+      }
+      value = mm;
+      break;
+    case RECIPE_STRIP:
+    case RECIPE_DWELL:
+      value = strtoul(arg, &end, 10);
+      if (*end != 0 || (arg[0] == 0 && op == RECIPE_DWELL) || value > (op == RECIPE_DWELL ? RECIPE_DWELL_MS : INT32_MAX)) {
+        return false;
+      }
+      break;
+    case RECIPE_FEED_REST:
+    case RECIPE_CUT:
+      if (arg[0] != 0) {
+        return false;
+      }
+      break;
+    default:
+      return false;
+    }
+    if (!parsed.add((RecipeOp) op, value)) {
+      return false;
+    }
+  }
+  if (parsed.count == 0) {
+    return false;
+  }
+  *this = parsed;
+  return true;
+}
+
+/** The recipe as parse() takes it. */
+String Recipe::format()
+{
+  String text;
+
+  for (int k = 0; k < count; k++) {
+    char line[32];
+
+    switch (steps[k].op) {
+    case RECIPE_FEED:
+    case RECIPE_FEED_TO:
+    case RECIPE_EJECT:
+      if (steps[k].arg > 0) {
+        snprintf(line, sizeof(line), "%s %ld.%03ld\n", opNames[steps[k].op], (long) (steps[k].arg >> FIX16_SHIFT), 
+                 (long) ((((steps[k].arg & (FIX16_ONE - 1)) * 1000) + FIX16_ONE / 2) >> FIX16_SHIFT));
+        break;
+      }
+      // fall through, the default length has no argument
+    case RECIPE_FEED_REST:
+    case RECIPE_CUT:
+      snprintf(line, sizeof(line), "%s\n", opNames[steps[k].op]);
+      break;
+    default:
+      snprintf(line, sizeof(line), "%s %ld\n", opNames[steps[k].op], (long) steps[k].arg);
+      break;
+    }
+    text += line;
+  }
+  return text;
+}
+
+/** The stored recipe, or the default one if there is none. */
+bool Recipe::load()
+{
+  File f = SPIFFS.open(RECIPE_FILE, FILE_READ);
+  char text[RECIPE_TEXT];
+  int  len = 0;
+
+  if (f) {
+    len = f.read((uint8_t *) text, sizeof(text) - 1);
+    f.close();
+  }
+  text[max(len, 0)] = 0;
+  if (len <= 0 || !parse(text)) {
+    setDefault();
+    return false;
+  }
+  return true;
+}
+
+/** Stores the recipe for the following jobs. Until the rename the old one stays valid. */
+bool Recipe::save()
+{
+  File   f    = SPIFFS.open(RECIPE_TEMP, FILE_WRITE);
+  String text = format();
+  bool   ok;
+
+  if (!f) {
+    return false;
+  }
+  ok = f.write((const uint8_t *) text.c_str(), text.length()) == text.length();
+  f.close();
+  if (ok) {
+    SPIFFS.remove(RECIPE_FILE);
+    ok = SPIFFS.rename(RECIPE_TEMP, RECIPE_FILE);
+  }
+  return ok;
+}
+
+/** What is left of the piece for RECIPE_FEED_REST. */
+fix16_t Recipe::restLength(fix16_t length)
+{
+  for (int k = 0; k < count; k++) {
+    if (steps[k].op == RECIPE_FEED) {
+      length -= steps[k].arg;
+    }
+  }
+  return max(length, (fix16_t) 0);
+}
+
+fix16_t Recipe::feedLength(const RecipeStep &step, fix16_t length)
+{
+  switch (step.op) {
+  case RECIPE_FEED:      return step.arg;
+  case RECIPE_FEED_REST: return restLength(length);
+  default:               return 0;
+  }
+}
+
+/** mm of the first feed the in roller may already do while the piece before is ejected.
+  * A recipe that starts with anything else than a plain feed has no prefeed.
+  */
+fix16_t Recipe::prefeed(fix16_t length)
+{
+  if (count == 0) {
+    return 0;
+  }
+  return min(feedLength(steps[0], length), PREFEED_LENGTH);
+}
+
+/** Compiles the segments of one piece, returns their number. The first feed is shortened 
+  * by what was prefed. A trim piece has no feeds, it only puts the wire end at the blade.
+  * The blade strokes start and end at the open position of the cutter. The feed after a 
+  * feed to the sensor starts at the sensor edge, the motor task takes off the overshoot.
+  * Segments without steps are left out, so the sequence numbers follow the list.
+  */
+int Recipe::compile(Motors &motors, Cutter &cutter, fix16_t length, fix16_t prefed, bool trim, RecipeSegment *out)
+{
+  SensorStop none    = { -1, false };
+  SensorStop atBlade = { SENSOR_CHANNEL_Y, true };
+  bool       sensed  = false;                  // A feed to the sensor waits for its overshoot to be taken off
+  int        n       = 0;
+
+  for (int k = 0; k < count; k++) {
+    const RecipeStep &step = steps[k];
+    Segment           segments[2];
+    JobPhase          phases[2];
+    int               parts = 0;
+
+    switch (step.op) {
+    case RECIPE_FEED:
+    case RECIPE_FEED_REST:
+      if (!trim) {
+        fix16_t mm     = feedLength(step, length);
+        fix16_t before = k == 0 ? prefed : 0;
+        long    x      = motors.toSteps(AXIS_X, mm) - motors.toSteps(AXIS_X, before);
+
+        phases  [parts]   = JOB_FEED;
+        segments[parts++] = Motors::makeSegment(-x, 0, -motors.toSteps(AXIS_Z, mm - before), false, none);
+        segments[parts - 1].afterTrip = sensed;
+        sensed = false;
+      }
+      break;
+    case RECIPE_FEED_TO:
+      if (!trim) {
+        phases  [parts]   = JOB_SENSE;
+        segments[parts++] = Motors::makeSegment(-motors.toSteps(AXIS_X, step.arg), 0, 0, false, atBlade);
+        sensed            = true;
+      }
+      break;
+    case RECIPE_STRIP:
+    case RECIPE_CUT:
+      {
+        long stroke = (step.op == RECIPE_CUT ? cutter.getClose() : (step.arg > 0 ? step.arg : STRIP_STROKE)) - cutter.getOpen();
+
+        stroke = max(stroke, 0L);
+
+        phases  [parts]   = step.op == RECIPE_CUT ? JOB_CUT : JOB_STRIP;
+        segments[parts++] = Motors::makeSegment(0,  stroke, 0, false, none);
+        phases  [parts]   = JOB_RETRACT;
+        segments[parts++] = Motors::makeSegment(0, -stroke, 0, false, none);
+      }
+      break;
+    case RECIPE_EJECT:
+      phases  [parts]   = JOB_EJECT;
+      segments[parts++] = Motors::makeSegment(0, 0, -motors.toSteps(AXIS_Z, step.arg > 0 ? step.arg : EJECT_LENGTH), true, none);
+      break;
+    case RECIPE_DWELL:
+      phases  [parts]   = JOB_DWELL;
+      segments[parts++] = Motors::makeSegment(0, 0, 0, false, none, (uint32_t) step.arg * 1000);
+      break;
+    default:
+      break;
+    }
+    for (int p = 0; p < parts; p++) {
+      if (segments[p].total > 0 || segments[p].dwellUs > 0) {
+        out[n].segment = segments[p];
+        out[n].phase   = phases[p];
+        n++;
+      }
+    }
+  }
+  return n;
+}
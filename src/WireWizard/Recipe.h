@@ -0,0 +1,112 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file Recipe.h
+  *
+  * Cut recipe, the operations that make one piece. A recipe is compiled into 
+  * a list of ready segments per piece length, the motor task runs them on its own
+  * including the sensor waits and the dwell times. Only the finished pieces
+  * go back to the loop task.
+  * The recipe of the next job is kept as text on the SPIFFS, one step per line,
+  * e.g. "feedto 40", "strip 3000", "feedrest", "cut", "eject".
+  */
+
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include "Motors.h"
+#include "Cutter.h"
+
+#define RECIPE_STEPS    12                     //!< Operations of one recipe
+#define RECIPE_SEGMENTS (2 * RECIPE_STEPS + 1) //!< Segments of one piece, including the prefeed of the next one
+#define RECIPE_FILE     "/recipe.txt"
+#define RECIPE_TEMP     "/recipe.tmp"          //!< The recipe is written here and renamed when complete
+#define RECIPE_TEXT     256                    //!< Longest recipe text
+#define RECIPE_DWELL_MS 60000                  //!< Longest dwell
+
+enum JobPhase {
+  JOB_WAIT,                                    //!< The motors waited for the next segment
+  JOB_FEED,
+  JOB_SENSE,                                   //!< Feed until the cutter sensor
+  JOB_STRIP,                                   //!< Cutter down for the insulation
+  JOB_CUT,                                     //!< Cutter down
+  JOB_RETRACT,                                 //!< Cutter up
+  JOB_EJECT,
+  JOB_DWELL,
+  JOB_PHASES
+};
+
+enum RecipeOp {
+  RECIPE_FEED,                                 //!< Feed arg mm (Q16.16) with both rollers
+  RECIPE_FEED_REST,                            //!< Feed the piece length less the other feeds with both rollers
+  RECIPE_FEED_TO,                              //!< Feed with the in roller until the cutter sensor, at most arg mm (Q16.16).
+                                               //!< The next feed is shortened by how far the wire ran past the sensor
+  RECIPE_STRIP,                                //!< Cutter down to arg steps and back, cuts the insulation only (0: STRIP_STROKE)
+  RECIPE_CUT,                                  //!< Cutter stroke of the wire gauge
+  RECIPE_EJECT,                                //!< Eject arg mm (Q16.16) with the out roller (0: EJECT_LENGTH)
+  RECIPE_DWELL,                                //!< Hold arg ms, at most RECIPE_DWELL_MS
+  RECIPE_OPS
+};
+
+/**
+  * One operation, the unit of arg depends on the operation: lengths are Q16.16 mm,
+  * the strip stroke steps and the dwell ms.
+  */
+struct RecipeStep
+{
+  RecipeOp op;
+  int32_t  arg;
+};
+
+/**
+  * One compiled segment and the phase its time is counted to.
+  */
+struct RecipeSegment
+{
+  Segment  segment;
+  JobPhase phase;
+};
+
+class Recipe
+{
+private:
+  RecipeStep steps[RECIPE_STEPS];
+  int        count;
+
+private:
+  fix16_t restLength(fix16_t length);
+  fix16_t feedLength(const RecipeStep &step, fix16_t length);
+
+public:
+  Recipe();
+
+  void clear()                   { count = 0; }
+  void setDefault();
+  bool add  (RecipeOp op, int32_t arg = 0);
+
+  int  getCount()                { return count;    }
+  const RecipeStep &getStep(int k) { return steps[k]; }
+
+  bool   parse (const char *text);
+  String format();
+  bool   load  ();
+  bool   save  ();
+
+  fix16_t prefeed(fix16_t length);
+  int     compile(Motors &motors, Cutter &cutter, fix16_t length, fix16_t prefed, bool trim, RecipeSegment *out);
+};
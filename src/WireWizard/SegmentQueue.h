@@ -0,0 +1,107 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file SegmentQueue.h
+  *
+  * Lock-free single producer / single consumer ring of motion segments.
+  * The loop task pushes, the motor task pops. Each index is written by
+  * one side only, so no lock is needed between the two cores.
+  */
+
+#include <Arduino.h>
+#include "Planner.h"
+
+#define SEGMENT_QUEUE_SIZE 32                  //!< Power of two
+
+/**
+  * Sensor edge that ends a move early.
+  */
+struct SensorStop
+{
+  int8_t   sensor;                             //!< Sensor channel, -1 for none
+  bool     rising;                             //!< Stop at a rising edge, else at a falling one
+};
+
+/**
+  * One coordinated move as it is queued for the motor task.
+  * A segment without steps holds all axes for its dwell time.
+  */
+struct Segment
+{
+  long     steps[AXIS_COUNT];                  //!< Signed steps per axis
+  long     total;                              //!< Steps of the leading axis
+  uint32_t seq;                                //!< Sequence number, set by push()
+  uint32_t queuedUs;                           //!< micros() when the segment was queued
+  bool     parallel;                           //!< May run beside other segments as long as the axes differ
+  SensorStop stop;                             //!< Decelerate as soon as the sensor trips
+  uint32_t dwellUs;                            //!< Pause before the next segment, only without steps
+  bool     afterTrip;                          //!< Shortened by how far the sensor move before it ran past its edge
+};
+
+class SegmentQueue
+{
+private:
+  Segment           segments[SEGMENT_QUEUE_SIZE];
+  volatile uint32_t head;                      //!< Written by the producer only
+  volatile uint32_t tail;                      //!< Written by the consumer only
+
+public:
+  SegmentQueue()
+    : head(0)
+    , tail(0)
+  {
+  }
+
+  uint32_t count()   { return head - tail; }
+  bool     isEmpty() { return head == tail; }
+  bool     isFull()  { return count() >= SEGMENT_QUEUE_SIZE; }
+
+  /** Producer side, returns false if the queue is full. */
+  bool push(const Segment &segment)
+  {
+    if (isFull()) {
+      return false;
+    }
+    segments[head & (SEGMENT_QUEUE_SIZE - 1)] = segment;
+    __sync_synchronize();
+    head++;
+    return true;
+  }
+
+  /** Consumer side, the segment stays valid until pop() is called. 
+    * Index 0 is the oldest segment, the consumer may look ahead up to count() - 1.
+    */
+  Segment *peek(uint32_t index = 0)
+  {
+    if (index >= count()) {
+      return NULL;
+    }
+    __sync_synchronize();
+    return &segments[(tail + index) & (SEGMENT_QUEUE_SIZE - 1)];
+  }
+
+  /** Consumer side. */
+  void pop()
+  {
+    if (!isEmpty()) {
+      __sync_synchronize();
+      tail++;
+    }
+  }
+};
@@ -0,0 +1,236 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Sensors.cpp
+  * 
+  * Continuous sampling of the light barriers.
+  */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "Sensors.h"
+
+#define SENSOR_CONV_RATE  (SENSOR_SAMPLE_RATE * SENSOR_COUNT)   //!< Conversions/s over all channels
+
+static_assert(SENSOR_CONV_RATE >= SOC_ADC_SAMPLE_FREQ_THRES_LOW, "The ADC dma refuses a lower conversion rate");
+
+static const adc_channel_t adcChannels[SENSOR_COUNT] = { ADC_CHANNEL_6, ADC_CHANNEL_7, ADC_CHANNEL_0 };
+static const int           sensorPins [SENSOR_COUNT] = { SENSOR_X,      SENSOR_Y,      SENSOR_Z      };
+
+Sensors::Sensors()
+  : overruns(0)
+  , taskHandle(NULL)
+  , edgeCount(0)
+  , listener(NULL)
+{
+  for (int channel = 0; channel < SENSOR_COUNT; channel++) {
+    head     [channel] = 0;
+    filtered [channel] = 0;
+    history  [channel][SENSOR_HISTORY - 1].value = 0;
+    lowLevel [channel] = 0;
+    highLevel[channel] = 4095 << 4;            // Until learned the threshold is in the middle
+    state    [channel] = false;
+    pending  [channel] = 0;
+  }
+}
+
+/** Middle between the learned levels. */
+int Sensors::getThreshold(int channel)
+{
+  return (lowLevel[channel] + highLevel[channel]) >> 5;
+}
+
+/** Returns false if the edge is not there yet or already overwritten. */
+bool Sensors::getEdge(uint32_t index, SensorEdge &edge)
+{
+  if ((int32_t) (edgeCount - index) <= 0) {
+    return false;
+  }
+  __sync_synchronize();
+  edge = edges[index & (SENSOR_EDGES - 1)];
+  __sync_synchronize();
+  return edgeCount - index <= SENSOR_EDGES;
+}
+
+/** Sensor task only. A change has to stay beyond the hysteresis for SENSOR_DEBOUNCE samples,
+  * the edge gets the time of the first one. While a state is stable its level is learned.
+  */
+void Sensors::detect(int channel, uint32_t us, uint16_t value)
+{
+  int32_t low        = lowLevel [channel] >> 4;
+  int32_t high       = highLevel[channel] >> 4;
+  int32_t threshold  = (low + high) / 2;
+  int32_t hysteresis = max(high - low, (int32_t) SENSOR_MIN_CONTRAST) / 4;
+  bool    beyond     = state[channel] ? value < threshold - hysteresis : value > threshold + hysteresis;
+
+  if (head[channel] == 0) {
+    state[channel] = value > threshold;
+    return;
+  }
+  if (!beyond) {
+    int32_t &level = state[channel] ? highLevel[channel] : lowLevel[channel];
+
+    level += (((int32_t) value << 4) - level) >> SENSOR_LEARN_SHIFT;
+    pending[channel] = 0;
+    return;
+  }
+  if (pending[channel] == 0) {
+    pendingUs[channel] = us;
+  }
+  if (++pending[channel] >= SENSOR_DEBOUNCE) {
+    SensorEdge &edge = edges[edgeCount & (SENSOR_EDGES - 1)];
+
+    state[channel]   = !state[channel];
+    pending[channel] = 0;
+
+    edge.us      = pendingUs[channel];
+    edge.channel = channel;
+    edge.rising  = state[channel];
+    __sync_synchronize();
+    edgeCount++;
+    if (listener) {
+      xTaskNotifyGive(listener);
+    }
+  }
+}
+
+/** Sensor task only. The sample is written before the head, so a reader never sees it half done. */
+void Sensors::store(int channel, uint32_t us, uint16_t value)
+{
+  detect(channel, us, value);
+
+  SensorSample &sample = history[channel][head[channel] & (SENSOR_HISTORY - 1)];
+
+  sample.us    = us;
+  sample.value = value;
+  if (head[channel] == 0) {
+    filtered[channel] = (int32_t) value << 4;
+  } else {
+    filtered[channel] += (((int32_t) value << 4) - filtered[channel]) >> SENSOR_FILTER_SHIFT;
+  }
+  __sync_synchronize();
+  head[channel]++;
+}
+
+/** Copies the latest samples, the newest one last. Returns the number of samples copied.
+  * If the sensor task has overwritten the oldest ones during the copy, it is done again.
+  */
+int Sensors::getHistory(int channel, SensorSample *samples, int count)
+{
+  while (true) {
+    uint32_t end = head[channel];
+    int      n   = min(count, (int) min(end, (uint32_t) SENSOR_HISTORY - SENSOR_FRAME));
+
+    __sync_synchronize();
+    for (int k = 0; k < n; k++) {
+      samples[k] = history[channel][(end - n + k) & (SENSOR_HISTORY - 1)];
+    }
+    __sync_synchronize();
+    if (head[channel] - end <= SENSOR_FRAME) {
+      return n;
+    }
+  }
+}
+
+/** Reads the dma frames and spreads the read time back over the conversions of the frame.
+  * The pattern converts the channels in turn, one conversion every 1 / SENSOR_CONV_RATE.
+  */
+void Sensors::sensorTask(void *parg)
+{
+  Sensors *sensors = (Sensors *) parg;
+  uint8_t  buffer[SENSOR_FRAME * sizeof(adc_digi_output_data_t)];
+
+  while (sensors) {
+    uint32_t  length = 0;
+    esp_err_t result = adc_digi_read_bytes(buffer, sizeof(buffer), &length, ADC_MAX_DELAY);
+    uint32_t  now    = micros();
+    uint32_t  count  = length / sizeof(adc_digi_output_data_t);
+
+    if (result == ESP_ERR_INVALID_STATE) {
+      sensors->overruns++;                     // Dma buffer overflowed, the data read is still valid
+    } else if (result != ESP_OK) {
+      continue;
+    }
+    for (uint32_t k = 0; k < count; k++) {
+      const adc_digi_output_data_t *data = (const adc_digi_output_data_t *) &buffer[k * sizeof(adc_digi_output_data_t)];
+      uint32_t                      us   = now - (uint64_t) (count - 1 - k) * 1000000UL / SENSOR_CONV_RATE;
+
+      for (int channel = 0; channel < SENSOR_COUNT; channel++) {
+        if (data->type1.channel == adcChannels[channel]) {
+          sensors->store(channel, us, data->type1.data);
+        }
+      }
+    }
+  }
+  vTaskDelete(NULL);
+}
+
+/** Fallback without the ADC dma, samples all channels every SENSOR_POLL_MS. */
+void Sensors::pollTask(void *parg)
+{
+  Sensors   *sensors = (Sensors *) parg;
+  TickType_t wake    = xTaskGetTickCount();
+
+  while (sensors) {
+    for (int channel = 0; channel < SENSOR_COUNT; channel++) {
+      sensors->store(channel, micros(), analogRead(sensorPins[channel]));
+    }
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(SENSOR_POLL_MS));
+  }
+  vTaskDelete(NULL);
+}
+
+void Sensors::begin()
+{
+  adc_digi_init_config_t    init = {};
+  adc_digi_configuration_t  config = {};
+  adc_digi_pattern_config_t pattern[SENSOR_COUNT] = {};
+
+  init.max_store_buf_size = SENSOR_FRAME * sizeof(adc_digi_output_data_t) * 4;
+  init.conv_num_each_intr = SENSOR_FRAME * sizeof(adc_digi_output_data_t);
+  init.adc1_chan_mask     = 0;
+  init.adc2_chan_mask     = 0;
+  for (int channel = 0; channel < SENSOR_COUNT; channel++) {
+    init.adc1_chan_mask      |= BIT(adcChannels[channel]);
+
+    pattern[channel].atten     = ADC_ATTEN_DB_11;   // Same range as analogRead()
+    pattern[channel].channel   = adcChannels[channel];
+    pattern[channel].unit      = 0;                 // ADC1
+    pattern[channel].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  }
+
+  config.conv_limit_en  = true;                     // Always on for the ESP32
+  config.conv_limit_num = 250;
+  config.pattern_num    = SENSOR_COUNT;
+  config.adc_pattern    = pattern;
+  config.sample_freq_hz = SENSOR_CONV_RATE;
+  config.conv_mode      = ADC_CONV_SINGLE_UNIT_1;
+  config.format         = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+
+  bool dma = adc_digi_initialize(&init) == ESP_OK;
+
+  if (dma && (adc_digi_controller_configure(&config) != ESP_OK || adc_digi_start() != ESP_OK)) {
+    adc_digi_deinitialize();
+    dma = false;
+  }
+  if (!dma) {
+    Serial.println("ADC dma not available, polling the sensors");
+    xTaskCreatePinnedToCore(pollTask, "sensorTask", 4096, this, 2, &taskHandle, 1);
+    return;
+  }
+  xTaskCreatePinnedToCore(sensorTask, "sensorTask", 4096, this, 2, &taskHandle, 1);
+}
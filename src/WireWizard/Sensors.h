@@ -24,31 +24,96 @@
   * @file Sensors.ino
   * 
   * Sensor file
+  * The light barriers are sampled continuously by the ADC dma (I2S0),
+  * a sensor task stores the samples into a ring buffer per channel.
+  * Without the dma the sensor task polls them with analogRead() instead.
+  * Readers never block: they get the latest filtered value or a copy of the history.
+  * An edge detector with learned levels, hysteresis and debounce turns the samples
+  * into timestamped rising/falling edges.
   */
 
-#define SENSOR_X GPIO_NUM_34
-#define SENSOR_Y GPIO_NUM_35
-#define SENSOR_Z GPIO_NUM_36
+#define SENSOR_X GPIO_NUM_34                   //!< ADC1 channel 6
+#define SENSOR_Y GPIO_NUM_35                   //!< ADC1 channel 7
+#define SENSOR_Z GPIO_NUM_36                   //!< ADC1 channel 0
+
+#define SENSOR_SAMPLE_RATE  7000               //!< Samples/s per channel, the ADC dma needs at least 20000 in total
+#define SENSOR_HISTORY      256                //!< Samples kept per channel (power of two)
+#define SENSOR_FRAME        42                 //!< Conversions per dma frame, 2 ms
+#define SENSOR_POLL_MS      1                  //!< Sample period without the dma
+#define SENSOR_FILTER_SHIFT 2                  //!< Exponential filter, a new sample weighs 1/4
+#define SENSOR_LEARN_SHIFT  8                  //!< Level learning, a new sample weighs 1/256
+#define SENSOR_MIN_CONTRAST 400                //!< Smallest distance between the learned levels
+#define SENSOR_DEBOUNCE     3                  //!< Samples an edge has to stay to be accepted
+#define SENSOR_EDGES        32                 //!< Edges kept (power of two)
+
+enum SensorChannel {
+  SENSOR_CHANNEL_X, SENSOR_CHANNEL_Y, SENSOR_CHANNEL_Z, SENSOR_COUNT
+};
+
+/**
+  * One ADC sample with the time of its conversion.
+  */
+struct SensorSample
+{
+  uint32_t us;                                 //!< micros() of the conversion
+  uint16_t value;                              //!< Raw 12 bit value
+};
+
+/**
+  * Debounced change of a sensor, timed by the first sample beyond the threshold.
+  */
+struct SensorEdge
+{
+  uint32_t us;                                 //!< micros() of the edge
+  uint8_t  channel;
+  bool     rising;
+};
 
 class Sensors
 {
+private:
+  SensorSample      history[SENSOR_COUNT][SENSOR_HISTORY];
+  volatile uint32_t head    [SENSOR_COUNT];    //!< Number of samples stored, written by the sensor task only
+  volatile int32_t  filtered[SENSOR_COUNT];    //!< Filter state, value << 4
+  volatile uint32_t overruns;                  //!< Dma frames lost because the sensor task was late
+  TaskHandle_t      taskHandle;
+
+  int32_t           lowLevel [SENSOR_COUNT];   //!< Learned level while low, value << 4
+  int32_t           highLevel[SENSOR_COUNT];   //!< Learned level while high, value << 4
+  volatile bool     state    [SENSOR_COUNT];   //!< Debounced state, true if high
+  uint8_t           pending  [SENSOR_COUNT];   //!< Samples beyond the threshold so far
+  uint32_t          pendingUs[SENSOR_COUNT];   //!< Time of the first of them
+  SensorEdge        edges[SENSOR_EDGES];
+  volatile uint32_t edgeCount;                 //!< Written by the sensor task only
+  TaskHandle_t      listener;                  //!< Notified on every edge
+
+private:
+  static void sensorTask(void *parg);
+  static void pollTask  (void *parg);
+
+  void store (int channel, uint32_t us, uint16_t value);
+  void detect(int channel, uint32_t us, uint16_t value);
+
 public:
-  void begin()
-  {
-  }
-  
-  int getX()
-  {
-    return analogRead(SENSOR_X);
-  }
-  
-  int getY()
-  {
-    return analogRead(SENSOR_Y);
-  }
+  Sensors();
+
+  void begin();
+
+  int      get       (int channel)   { return filtered[channel] >> 4; }
+  int      getRaw    (int channel)   { return history[channel][(head[channel] - 1) & (SENSOR_HISTORY - 1)].value; }
+  uint32_t getCount  (int channel)   { return head[channel]; }
+  uint32_t getAgeUs  (int channel)   { return micros() - history[channel][(head[channel] - 1) & (SENSOR_HISTORY - 1)].us; }
+  uint32_t getOverruns()             { return overruns;      }
+
+  int      getHistory(int channel, SensorSample *samples, int count);
+
+  bool     isHigh      (int channel) { return state[channel];  }
+  int      getThreshold(int channel);
+  uint32_t getEdgeCount()            { return edgeCount;       }
+  bool     getEdge     (uint32_t index, SensorEdge &edge);
+  void     setListener (TaskHandle_t task) { listener = task;  }
   
-  int getZ()
-  {
-    return analogRead(SENSOR_Z);
-  }
+  int getX()                         { return get(SENSOR_CHANNEL_X); }
+  int getY()                         { return get(SENSOR_CHANNEL_Y); }
+  int getZ()                         { return get(SENSOR_CHANNEL_Z); }
 };
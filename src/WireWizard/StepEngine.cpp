@@ -0,0 +1,282 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file StepEngine.cpp
+  *
+  * Hardware timed output of the 74HC595 stepper frames.
+  */
+
+#include <soc/gpio_struct.h>
+#include "StepEngine.h"
+
+static portMUX_TYPE stepEngineMux = portMUX_INITIALIZER_UNLOCKED;
+
+StepEngine::StepEngine()
+  : output(OUTPUT_TIMER)
+  , i2sResidualUs(0)
+  , i2sIdle(false)
+  , head(0)
+  , tail(0)
+  , running(false)
+  , flushRequest(false)
+  , streaming(false)
+  , pushedUs(0)
+  , outputUs(0)
+  , idleValue(0b00000001)
+  , waiter(NULL)
+  , wanted(STEP_LOW_WATER)
+  , nextAlarm(0)
+  , latchMask(0)
+  , clockMask(0)
+  , dataMask(0)
+{
+  resetStats();
+}
+
+void StepEngine::resetStats()
+{
+  maxJitterUs    = output == OUTPUT_I2S ? I2S_OUT_SAMPLE_US : 0;  // I2S is quantized to the sample clock only
+  minLateUs      = UINT32_MAX;
+  maxLateUs      = 0;
+  maxStepRate    = 0;
+  underruns      = 0;
+  stepCount      = 0;
+  windowStart    = 0;
+  windowSteps    = 0;
+  windowUnderrun = true;
+}
+
+void IRAM_ATTR StepEngine::shiftOut(uint8_t value)
+{
+  for (int bit = 7; bit >= 0; bit--) {
+    if (value & (1 << bit)) {
+      GPIO.out_w1ts = dataMask;
+    } else {
+      GPIO.out_w1tc = dataMask;
+    }
+    GPIO.out_w1ts = clockMask;
+    GPIO.out_w1tc = clockMask;
+  }
+  GPIO.out_w1ts = latchMask;                    // Schieberegister-Puffer übernehmen
+  GPIO.out_w1tc = latchMask;
+}
+
+void IRAM_ATTR StepEngine::account(uint64_t now, const StepFrame &frame)
+{
+  if (frame.step) {
+    stepCount++;
+    windowSteps++;
+  }
+  if (now - windowStart >= STEP_RATE_WINDOW) {
+    if (!windowUnderrun) {
+      uint32_t rate = (uint64_t) windowSteps * 1000000 / (now - windowStart);
+
+      if (rate > maxStepRate) {
+        maxStepRate = rate;
+      }
+    }
+    windowStart    = now;
+    windowSteps    = 0;
+    windowUnderrun = false;
+  }
+}
+
+bool IRAM_ATTR StepEngine::onTimer(void *parg)
+{
+  StepEngine *engine = (StepEngine *) parg;
+  uint64_t    now    = timer_group_get_counter_value_in_isr(STEP_TIMER_GROUP, STEP_TIMER_IDX);
+  BaseType_t  woken  = pdFALSE;
+
+  if (engine->flushRequest) {
+    engine->tail         = engine->head;
+    engine->outputUs     = engine->pushedUs;
+    engine->flushRequest = false;
+  }
+
+  if (engine->tail != engine->head) {
+    const StepFrame &frame  = engine->frames[engine->tail & (STEP_FRAME_COUNT - 1)];
+    uint32_t         lateUs = (uint32_t) (now - engine->nextAlarm);
+
+    engine->shiftOut(frame.value);
+
+    if (lateUs < engine->minLateUs) engine->minLateUs = lateUs;
+    if (lateUs > engine->maxLateUs) engine->maxLateUs = lateUs;
+    engine->maxJitterUs = engine->maxLateUs - engine->minLateUs;
+    engine->account(now, frame);
+    engine->nextAlarm += frame.holdUs;
+    engine->outputUs  += frame.holdUs;
+    engine->tail++;
+
+    timer_group_set_alarm_value_in_isr(STEP_TIMER_GROUP, STEP_TIMER_IDX, engine->nextAlarm);
+    timer_group_enable_alarm_in_isr(STEP_TIMER_GROUP, STEP_TIMER_IDX);
+  } else {
+    if (engine->streaming) {
+      engine->underruns++;
+      engine->windowUnderrun = true;
+    }
+    engine->shiftOut(engine->idleValue);
+    engine->running = false;
+  }
+
+  if (engine->waiter && engine->space() >= engine->wanted) {
+    vTaskNotifyGiveFromISR(engine->waiter, &woken);
+    engine->waiter = NULL;
+  }
+  return woken == pdTRUE;
+}
+
+/** Renders the frame into the I2S stream. The statistics run on the sample clock instead of the timer,
+  * a dma ring that ran dry during a move counts as an underrun like an empty timer ring buffer.
+  */
+void StepEngine::pushI2S(const StepFrame &frame)
+{
+  uint32_t holdUs  = frame.holdUs + i2sResidualUs;
+  uint32_t samples = max(holdUs / I2S_OUT_SAMPLE_US, (uint32_t) 1);
+  uint32_t dry     = i2s.getUnderruns();
+
+  i2sResidualUs = holdUs > samples * I2S_OUT_SAMPLE_US ? holdUs - samples * I2S_OUT_SAMPLE_US : 0;
+  i2s.write(frame.value, samples);
+  i2sIdle = false;
+  if (i2s.getUnderruns() != dry) {
+    underruns++;
+    windowUnderrun = true;
+  }
+
+  nextAlarm += samples * I2S_OUT_SAMPLE_US;
+  account(nextAlarm, frame);
+}
+
+bool StepEngine::push(uint8_t value, bool step, uint32_t holdUs)
+{
+  if (space() == 0) {
+    return false;
+  }
+
+  StepFrame &frame = frames[head & (STEP_FRAME_COUNT - 1)];
+
+  frame.value  = value;
+  frame.step   = step;
+  frame.holdUs = holdUs;
+  pushedUs    += holdUs;
+
+  if (output == OUTPUT_I2S) {
+    pushI2S(frame);
+    return true;
+  }
+  __sync_synchronize();
+  head++;
+
+  if (!running) {
+    portENTER_CRITICAL(&stepEngineMux);
+    running   = true;
+    nextAlarm = timer_group_get_counter_value_in_isr(STEP_TIMER_GROUP, STEP_TIMER_IDX) + 2;
+    timer_group_set_alarm_value_in_isr(STEP_TIMER_GROUP, STEP_TIMER_IDX, nextAlarm);
+    timer_group_enable_alarm_in_isr(STEP_TIMER_GROUP, STEP_TIMER_IDX);
+    portEXIT_CRITICAL(&stepEngineMux);
+  }
+  return true;
+}
+
+/** Blocks the motor task until the timer interrupt has made room for the given number of frames,
+  * or a sensor edge comes. The I2S output blocks in its write instead, here it only waits a tick.
+  */
+void StepEngine::waitForSpace(uint32_t free)
+{
+  if (output == OUTPUT_TIMER) {
+    wanted = free;
+    waiter = xTaskGetCurrentTaskHandle();
+    __sync_synchronize();
+    if (space() < free && running) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+    }
+    waiter = NULL;
+  } else {
+    ulTaskNotifyTake(pdTRUE, 1);
+  }
+}
+
+/** Drops all frames not yet out. In I2S mode the dma ring is overwritten, so a stop takes effect at once. */
+void StepEngine::flush()
+{
+  if (output == OUTPUT_I2S) {
+    i2sResidualUs = 0;
+    i2s.stop(idleValue);
+    i2sIdle = true;
+  } else if (running) {
+    flushRequest = true;
+  }
+}
+
+/** In I2S mode the whole dma ring is filled with the idle value. It holds for the 8 ms 
+  * of the ring, then the dma sends zeros: no steps, the drivers enabled and the beeper off.
+  */
+void StepEngine::setIdleValue(uint8_t value)
+{
+  if (output == OUTPUT_I2S) {
+    if (!i2sIdle || value != idleValue) {
+      i2sResidualUs = 0;
+      i2s.fill(value);
+      i2sIdle = true;
+    }
+    idleValue = value;
+  } else {
+    idleValue = value;
+    if (!running) {
+      shiftOut(value);
+    }
+  }
+}
+
+/** Has to be called from the motor task to get the interrupt on the same core. 
+  * Falls back to the timer output if the I2S driver could not be installed. 
+  */
+void StepEngine::begin(int latchPin, int clockPin, int dataPin, Output out)
+{
+  if (out == OUTPUT_I2S) {
+    if (i2s.begin(latchPin, clockPin, dataPin)) {
+      output = OUTPUT_I2S;
+      resetStats();
+      setIdleValue(idleValue);
+      return;
+    }
+    Serial.println("I2S output not available, using the timer output");
+  }
+  output = OUTPUT_TIMER;
+
+  pinMode(latchPin, OUTPUT);
+  pinMode(clockPin, OUTPUT);
+  pinMode(dataPin,  OUTPUT);
+
+  latchMask = 1UL << latchPin;
+  clockMask = 1UL << clockPin;
+  dataMask  = 1UL << dataPin;
+
+  timer_config_t config = {};
+
+  config.divider     = STEP_TIMER_DIV;
+  config.counter_dir = TIMER_COUNT_UP;
+  config.counter_en  = TIMER_PAUSE;
+  config.alarm_en    = TIMER_ALARM_DIS;
+  config.auto_reload = TIMER_AUTORELOAD_DIS;
+
+  timer_init(STEP_TIMER_GROUP, STEP_TIMER_IDX, &config);
+  timer_set_counter_value(STEP_TIMER_GROUP, STEP_TIMER_IDX, 0);
+  timer_isr_callback_add(STEP_TIMER_GROUP, STEP_TIMER_IDX, onTimer, this, ESP_INTR_FLAG_IRAM);
+  timer_start(STEP_TIMER_GROUP, STEP_TIMER_IDX);
+
+  shiftOut(idleValue);
+}
@@ -0,0 +1,126 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file StepEngine.h
+  *
+  * Hardware timed output of the 74HC595 stepper frames.
+  * The motor task fills a ring buffer with frames (port value + hold time),
+  * a hardware timer interrupt shifts them out at the exact time.
+  * Alternatively the frames are rendered into an I2S dma stream (see I2SOut).
+  */
+
+#include <Arduino.h>
+#include <driver/timer.h>
+#include "I2SOut.h"
+
+#define STEP_TIMER_GROUP  TIMER_GROUP_0
+#define STEP_TIMER_IDX    TIMER_0
+#define STEP_TIMER_DIV    80                   //!< 80 MHz APB / 80 = 1 tick per us
+#define STEP_FRAME_COUNT  256                  //!< Ring buffer size (power of two)
+#define STEP_RATE_WINDOW  100000               //!< Window for the step rate measurement in us
+#define STEP_LOW_WATER    (STEP_FRAME_COUNT / 2)  //!< Free frames at which a waiting motor task is woken up
+
+/**
+  * One output frame: the value of the shift register and how long it stays there.
+  */
+struct StepFrame
+{
+  uint8_t  value;       //!< Value for the shift register
+  bool     step;        //!< Frame contains at least one step pulse
+  uint32_t holdUs;      //!< Time until the next frame will be written
+};
+
+class StepEngine
+{
+public:
+  enum Output {
+    OUTPUT_TIMER,                    //!< Timer interrupt bit-bangs the shift register
+    OUTPUT_I2S                       //!< I2S dma streams the frames at a fixed sample rate
+  };
+
+private:
+  Output            output;
+  I2SOut            i2s;
+  uint32_t          i2sResidualUs;   //!< Rest of the hold time not covered by whole samples
+  bool              i2sIdle;         //!< The dma ring was filled with the idle value
+
+  StepFrame         frames[STEP_FRAME_COUNT];
+  volatile uint32_t head;            //!< Written by the motor task only
+  volatile uint32_t tail;            //!< Written by the timer interrupt only
+  volatile bool     running;
+  volatile bool     flushRequest;
+  volatile bool     streaming;
+  uint32_t          pushedUs;        //!< Sum of the hold times pushed, written by the motor task only
+  volatile uint32_t outputUs;        //!< Sum of the hold times shifted out, written by the timer interrupt only
+  volatile uint8_t  idleValue;
+  TaskHandle_t      waiter;          //!< Task waiting for free frames
+  uint32_t          wanted;          //!< Free frames the waiting task is woken up at
+
+  uint64_t          nextAlarm;
+
+  uint32_t          latchMask;
+  uint32_t          clockMask;
+  uint32_t          dataMask;
+
+  // Statistics, written by the timer interrupt
+  volatile uint32_t maxJitterUs;
+  uint32_t          minLateUs;
+  uint32_t          maxLateUs;
+  volatile uint32_t maxStepRate;
+  volatile uint32_t underruns;
+  volatile uint32_t stepCount;
+  uint64_t          windowStart;
+  uint32_t          windowSteps;
+  bool              windowUnderrun;
+
+private:
+  static bool IRAM_ATTR onTimer(void *parg);
+
+  void IRAM_ATTR shiftOut (uint8_t value);
+  void IRAM_ATTR account  (uint64_t now, const StepFrame &frame);
+
+  void pushI2S (const StepFrame &frame);
+
+public:
+  StepEngine();
+
+  void begin(int latchPin, int clockPin, int dataPin, Output out = OUTPUT_TIMER);
+
+  bool push(uint8_t value, bool step, uint32_t holdUs);
+  void flush();
+  void waitForSpace(uint32_t free = STEP_LOW_WATER);
+
+  Output   getOutput()          { return output;            }
+
+  uint32_t space()              { return output == OUTPUT_I2S ? STEP_FRAME_COUNT : STEP_FRAME_COUNT - (head - tail); }
+  bool     isEmpty()            { return output == OUTPUT_I2S ? i2s.isDrained()  : head == tail; }
+  bool     isRunning()          { return running;           }
+  uint32_t getLeadUs()          { return output == OUTPUT_I2S ? i2s.getLeadUs() : pushedUs - outputUs; }
+  bool     isAhead(uint32_t frames, uint32_t us) { return output == OUTPUT_I2S ? i2s.getLeadUs() > us : STEP_FRAME_COUNT - space() > frames; }
+
+  void     setIdleValue(uint8_t value);
+  void     setStreaming(bool on) { streaming = on;         }
+
+  uint32_t getMaxJitterUs()     { return maxJitterUs;       }
+  uint32_t getMaxStepRate()     { return maxStepRate;       }
+  uint32_t getUnderruns()       { return underruns;         }
+  uint32_t getStepCount()       { return stepCount;         }
+
+  void     resetStats();
+};
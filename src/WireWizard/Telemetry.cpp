@@ -0,0 +1,65 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Telemetry.cpp
+  * 
+  * Snapshot of the machine state.
+  */
+
+#include "Telemetry.h"
+
+Telemetry telemetry;
+
+Telemetry::Telemetry()
+  : seq(0)
+{
+  memset(&data, 0, sizeof(data));
+}
+
+/** Only one task may publish. */
+void Telemetry::publish(const TelemetryData &d)
+{
+  seq++;
+  __sync_synchronize();
+  memcpy(&data, &d, sizeof(data));
+  __sync_synchronize();
+  seq++;
+}
+
+/** Never waits: returns false if the writer was busy in each of the TELEMETRY_TRIES copies, 
+  * d keeps the last snapshot then.
+  */
+bool Telemetry::read(TelemetryData &d)
+{
+  TelemetryData copy;
+
+  for (int k = 0; k < TELEMETRY_TRIES; k++) {
+    uint32_t before = seq;
+
+    __sync_synchronize();
+    if (before & 1) {
+      continue;
+    }
+    memcpy(&copy, &data, sizeof(copy));
+    __sync_synchronize();
+    if (seq == before) {
+      d = copy;
+      return true;
+    }
+  }
+  return false;
+}
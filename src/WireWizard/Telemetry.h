@@ -0,0 +1,63 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file Telemetry.h
+  * 
+  * Snapshot of the machine state for the display and the web server.
+  * The loop task publishes it as a plain struct under a sequence lock, 
+  * readers copy it without ever blocking the writer and format it only
+  * when they show it.
+  */
+
+#include <Arduino.h>
+#include "Sensors.h"
+#include "Motors.h"
+
+#define TELEMETRY_TRIES 4                      //!< Copies a reader tries before it keeps its last one
+
+/**
+  * Published values, no pointers and no Strings.
+  */
+struct TelemetryData
+{
+  uint32_t us;                                 //!< micros() of the snapshot
+  int32_t  sensor[SENSOR_COUNT];               //!< Filtered values
+  int32_t  pos   [AXIS_COUNT];                 //!< Steps
+  uint8_t  state;                              //!< ControllerState
+  bool     enabled;                            //!< Motors on
+  bool     paused;                             //!< Job paused
+  uint32_t made;                               //!< Pieces of the job
+  uint32_t total;
+  uint32_t piecesPerHour;
+};
+
+class Telemetry
+{
+private:
+  TelemetryData     data;
+  volatile uint32_t seq;                       //!< Odd while the data is written
+
+public:
+  Telemetry();
+
+  void publish(const TelemetryData &d);
+  bool read   (TelemetryData &d);
+};
+
+extern Telemetry telemetry;
@@ -27,8 +27,21 @@
 #include <SPIFFS.h>
 #include <ESPAsyncWebServer.h>
 #include "EventQueue.h"
+#include "CutList.h"
+#include "Recipe.h"
+#include "Profiler.h"
+#include "Telemetry.h"
 
 
+/**
+  * Body of a posted recipe, one per request in its _tempObject, freed with the request.
+  */
+struct RecipeBody
+{
+  size_t len;
+  char   text[RECIPE_TEXT];
+};
+
 /**
   * My Webserver interface. Works together with .html, .css and .js files from the SPIFFS.
   */
@@ -36,6 +49,9 @@ class MyWebServer
 {
 protected:
   AsyncWebServer server;
+  CutList       &cutList;
+  CsvImport      csvImport;
+  Profiler      &profiler;
 
 private:
   String WifiGetRssiAsQuality(int rssi);
@@ -44,9 +60,16 @@ private:
   void   handleMain       (AsyncWebServerRequest *request);
   void   handlePushButton (AsyncWebServerRequest *request);
   void   handleNotFound   (AsyncWebServerRequest *request);
+  void   handleUpload     (AsyncWebServerRequest *request, size_t index, uint8_t *data, size_t len, bool final);
+  void   handleUploadDone (AsyncWebServerRequest *request);
+  void   handleStats      (AsyncWebServerRequest *request);
+  void   handleTelemetry  (AsyncWebServerRequest *request);
+  void   handleRecipe     (AsyncWebServerRequest *request);
+  void   handleRecipeBody (AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index);
+  void   handleRecipeDone (AsyncWebServerRequest *request);
 
 public:
-  MyWebServer();
+  MyWebServer(CutList &list, Profiler &p);
   
   bool begin();
 };
@@ -54,8 +77,11 @@ public:
 /* ******************************************** */
 
 /** Constructor/Destructor */
-MyWebServer::MyWebServer()
+MyWebServer::MyWebServer(CutList &list, Profiler &p)
   : server(80)
+  , cutList(list)
+  , csvImport(list)
+  , profiler(p)
 {
 }
 
@@ -111,6 +137,23 @@ bool MyWebServer::begin()
   server.on("/",          HTTP_GET, [this](AsyncWebServerRequest *request) { this->handleRoot(request);       });
   server.on("/Main.html", HTTP_GET, [this](AsyncWebServerRequest *request) { this->handleMain(request);       });
   server.on("/button",    HTTP_GET, [this](AsyncWebServerRequest *request) { this->handlePushButton(request); });
+  server.on("/stats",     HTTP_GET, [this](AsyncWebServerRequest *request) { this->handleStats(request);      });
+  server.on("/telemetry", HTTP_GET, [this](AsyncWebServerRequest *request) { this->handleTelemetry(request);  });
+  server.on("/recipe",    HTTP_GET, [this](AsyncWebServerRequest *request) { this->handleRecipe(request);     });
+  server.on("/recipe",    HTTP_POST,
+            [this](AsyncWebServerRequest *request) { this->handleRecipeDone(request); },
+            NULL,
+            [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+              this->handleRecipeBody(request, data, len, index);
+            });
+  server.on("/upload",    HTTP_POST,
+            [this](AsyncWebServerRequest *request) { this->handleUploadDone(request); },
+            [this](AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final) {
+              this->handleUpload(request, index, data, len, final);
+            },
+            [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+              this->handleUpload(request, index, data, len, index + len >= total);
+            });
   server.onNotFound(                [this](AsyncWebServerRequest *request) { this->handleNotFound(request);   }); 
   
   server.begin(); 
@@ -205,9 +248,139 @@ void MyWebServer::handlePushButton(AsyncWebServerRequest *request)
     } else if (buttonName == "Speed") {
       event.pushButton = Event::SPEED;
       event.speed      = atoi(buttonValue.c_str());
+    } else if (buttonName == "Wire") {
+      event.pushButton = Event::WIRE;
+      event.wire       = atoi(buttonValue.c_str());
+    } else if (buttonName == "Learn") {
+      event.pushButton = Event::LEARN;
     }
     eventQueue.send(event);
     
     request->send(200, "text/html", response);    
   }
 }
+
+/** One chunk of a cut list, as multipart file upload or as plain text/csv body.
+  * The rows go into the cut list as they arrive, nothing is buffered.
+  * If the client disconnects before the last chunk, the stored list is kept.
+  */
+void MyWebServer::handleUpload(AsyncWebServerRequest *request, size_t index, uint8_t *data, size_t len, bool final)
+{
+  if (index == 0) {
+    if (!csvImport.begin(request)) {
+      return;
+    }
+    request->onDisconnect([this, request]() { this->csvImport.abort(request); });
+  }
+  csvImport.feed(request, data, len);
+  if (final) {
+    csvImport.end(request);
+  }
+}
+
+/** Answers the upload with the import statistics. */
+void MyWebServer::handleUploadDone(AsyncWebServerRequest *request)
+{
+  Serial.println("handleUploadDone");
+
+  csvImport.end(request);
+  if (!csvImport.hasImported(request)) {
+    request->send(409, "text/plain", "Cut list is in use!");
+    return;
+  }
+
+  uint32_t totalUs = csvImport.getTotalUs();
+  uint32_t busyUs  = csvImport.getBusyUs();
+  String   result  = (String) csvImport.getRows() + " rows, " + csvImport.getErrors() + " errors, " + cutList.getTotal() + " pieces, " +
+                     csvImport.getBytes() + " bytes in " + totalUs / 1000 + " ms (import " + busyUs / 1000 + " ms, " +
+                     (busyUs > 0 ? (uint64_t) csvImport.getRows() * US_PER_S / busyUs : 0) + " rows/s)";
+
+  Serial.println("Cut list: " + result);
+  request->send(200, "text/plain", result);
+}
+
+/** The cycle time statistics as plain text, /stats?reset clears them. */
+void MyWebServer::handleStats(AsyncWebServerRequest *request)
+{
+  Serial.println("handleStats");
+
+  if (request->hasArg("reset")) {
+    profiler.clear();
+  }
+  request->send(200, "text/plain", profiler.report());
+}
+
+/** The recipe of the next job as text, one step per line. */
+void MyWebServer::handleRecipe(AsyncWebServerRequest *request)
+{
+  Recipe recipe;
+
+  Serial.println("handleRecipe");
+
+  recipe.load();
+  request->send(200, "text/plain", recipe.format());
+}
+
+/** Collects the posted recipe text, a longer one is refused. */
+void MyWebServer::handleRecipeBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index)
+{
+  RecipeBody *body = (RecipeBody *) request->_tempObject;
+
+  if (body == NULL) {
+    body = (RecipeBody *) malloc(sizeof(RecipeBody));
+    if (body == NULL) {
+      return;
+    }
+    body->len = 0;
+    request->_tempObject = body;
+  }
+  if (body->len + len < sizeof(body->text)) {
+    memcpy(body->text + body->len, data, len);
+    body->len += len;
+  } else {
+    body->len = sizeof(body->text);
+  }
+}
+
+/** Stores a posted recipe for the next job, a running job keeps its own. */
+void MyWebServer::handleRecipeDone(AsyncWebServerRequest *request)
+{
+  Recipe      recipe;
+  RecipeBody *body = (RecipeBody *) request->_tempObject;
+
+  Serial.println("handleRecipeDone");
+
+  if (body == NULL || body->len == 0 || body->len >= sizeof(body->text)) {
+    request->send(400, "text/plain", "Recipe missing or too long!");
+    return;
+  }
+  body->text[body->len] = 0;
+  if (!recipe.parse(body->text)) {
+    request->send(400, "text/plain", "Invalid recipe!");
+  } else if (!recipe.save()) {
+    request->send(500, "text/plain", "Recipe not saved!");
+  } else {
+    request->send(200, "text/plain", recipe.format());
+  }
+}
+
+/** The telemetry snapshot as json, formatted into a fixed buffer. */
+void MyWebServer::handleTelemetry(AsyncWebServerRequest *request)
+{
+  TelemetryData data;
+  char          json[256];
+
+  if (!telemetry.read(data)) {
+    request->send(503, "text/plain", "Try again");
+    return;
+  }
+  snprintf(json, sizeof(json),
+           "{\"us\":%lu,\"sensor\":[%ld,%ld,%ld],\"pos\":[%ld,%ld,%ld],\"state\":%u,\"enabled\":%s,"
+           "\"paused\":%s,\"made\":%lu,\"total\":%lu,\"piecesPerHour\":%lu}",
+           (unsigned long) data.us,
+           (long) data.sensor[SENSOR_CHANNEL_X], (long) data.sensor[SENSOR_CHANNEL_Y], (long) data.sensor[SENSOR_CHANNEL_Z],
+           (long) data.pos[AXIS_X], (long) data.pos[AXIS_Y], (long) data.pos[AXIS_Z],
+           data.state, data.enabled ? "true" : "false", data.paused ? "true" : "false",
+           (unsigned long) data.made, (unsigned long) data.total, (unsigned long) data.piecesPerHour);
+  request->send(200, "application/json", json);
+}
@@ -39,7 +39,7 @@ Motors      motors;
 Sensors     sensors;
 Controller  controller(motors, sensors);
 Display     display;
-MyWebServer webServer;
+MyWebServer webServer(controller.getCutList(), controller.getProfiler());
 
 
 void setup() 
@@ -51,6 +51,15 @@ void setup()
 
   SPI.begin();
 
+  AxisConfig axisX = AXIS_X_CONFIG;
+  AxisConfig axisY = AXIS_Y_CONFIG;
+  AxisConfig axisZ = AXIS_Z_CONFIG;
+
+  motors.setAxis(AXIS_X, axisX);
+  motors.setAxis(AXIS_Y, axisY);
+  motors.setAxis(AXIS_Z, axisZ);
+  motors.setOutput(STEP_I2S ? StepEngine::OUTPUT_I2S : StepEngine::OUTPUT_TIMER);
+  motors.setSensors(&sensors);
   motors.begin();
   motors.delay(0);
   motors.enable(true);
@@ -59,12 +68,38 @@ void setup()
   controller.begin();
   display.begin();
 
-  // webServer.begin();
+  if (WEB_SERVER) {
+    webServer.begin();                         // After the controller has mounted SPIFFS
+  }
 }
 
 #define MAX_DELAY 1000
 #define MAX_STEPS 10 * 16 * 200
 
+#define LOOP_PERIOD_MS      10                 //!< Longest time between two controller ticks
+#define TELEMETRY_PERIOD_MS 100                //!< Snapshot of the machine state for the display and the web server
+
+/** Waits for a sensor move and prints where the sensor tripped. */
+bool waitForTrip(uint32_t seq, const char *name)
+{
+  SensorTrip trip;
+  int        ticks = millis();
+
+  while (!motors.isDone(seq)) {
+    delay(10);
+    if (millis() - ticks > 5000) {
+      motors.resetSteps();
+      return false;
+    }
+  }
+  if (!motors.getTrip(seq, trip)) {
+    Serial.println((String) name + " not reached");
+    return false;
+  }
+  Serial.println((String) name + " at X " + trip.pos[AXIS_X] + ", Z " + trip.pos[AXIS_Z] + " (lead " + motors.getTripLeadUs() + " us)");
+  return true;
+}
+
 void testCut()
 {
   int ticks = millis();
@@ -73,36 +108,16 @@ void testCut()
   motors.delay(1000);
 
   Serial.println("Fill in");
-  ticks = millis();
-  motors.stepX(-100000);
-  Serial.println("Wait for cutter sensor");
-  while (sensors.getY() < 3000) {
-    delay(100);
-    if (millis() - ticks > 5000) {
-      break;
-      // return;
-    }
-  };
-  motors.resetSteps();
+  SensorStop cutterSensor = { SENSOR_CHANNEL_Y, true };
+  waitForTrip(motors.moveUntil(-100000, 0, 0, cutterSensor), "Cutter sensor");
 
   Serial.println("Move forward");
-  ticks = millis();
-  motors.stepX(-100000);
-  motors.stepZ(-100000);
-  Serial.println("Wait for out sensor");
-  while (sensors.getZ() < 3000) {
-    delay(100);
-    if (millis() - ticks > 5000) {
-      break;
-      // return;
-    }
-  };
-  motors.resetSteps();
+  SensorStop outSensor = { SENSOR_CHANNEL_Z, true };
+  waitForTrip(motors.moveUntil(-100000, 0, -100000, outSensor), "Out sensor");
 
   Serial.println("Move a bit forward");
   ticks = millis();
-  motors.stepX(-3000);
-  motors.stepZ(-3000);
+  motors.move(-3000, 0, -3000);
   while (!motors.isIdle()) {
     delay(100);
     if (millis() - ticks > 5000) {
@@ -114,7 +129,7 @@ void testCut()
 
   Serial.println("Cut");
   ticks = millis();
-  motors.stepY(4000);
+  motors.move(0, 4000, 0);
   while (!motors.isIdle()) {
     delay(100);
     if (millis() - ticks > 5000) {
@@ -123,7 +138,7 @@ void testCut()
     }
   }
   ticks = millis();
-  motors.stepY(-4000);
+  motors.move(0, -4000, 0);
   while (!motors.isIdle()) {
     delay(100);
     if (millis() - ticks > 5000) {
@@ -133,72 +148,136 @@ void testCut()
   }
 
   Serial.println("Move out");
-  ticks = millis();
-  motors.stepZ(-200000);
-  Serial.println("Wait for out");
-  while (sensors.getZ() > 3000) {
-    delay(100);
-    if (millis() - ticks > 5000) {
-      break;
-      // return;
-    }
-  };
+  SensorStop outFree = { SENSOR_CHANNEL_Z, false };
+  waitForTrip(motors.moveUntil(0, 0, -200000, outFree), "Out");
 
   motors.beep(100);
-  motors.resetSteps();
 
   Serial.println("Finish");
 }
 
+/** Prints the last feed measurement, the deviation in per mille. */
+void printFeed()
+{
+  FeedMeter &meter = controller.getMeter();
+
+  if (meter.getCount() == 0) {
+    return;
+  }
+  Serial.println((String) "Feed: X " + String(meter.getMeasured(AXIS_X) / (float) FIX16_ONE, 3) + " steps/mm (" + fix16ToLong(meter.getError(AXIS_X) * 1000) + "/1000), " +
+                 "Z " + String(meter.getMeasured(AXIS_Z) / (float) FIX16_ONE, 3) + " steps/mm (" + fix16ToLong(meter.getError(AXIS_Z) * 1000) + "/1000), " + 
+                 meter.getSlips() + " slips in " + meter.getCount() + " measurements");
+}
+
+/** Prints the throughput of the last job. */
+void printJob()
+{
+  CutJob &job = controller.getJob();
+
+  Serial.println((String) "Job: " + job.getMade() + "/" + job.getTotal() + " pieces, " + job.getPiecesPerHour() + " pieces/h, last cycle " + 
+                 job.getCycleUs() / 1000 + " ms");
+}
+
+/** Publishes the machine state, the display and the web server format it themselves. */
+void publishTelemetry()
+{
+  CutJob       &job = controller.getJob();
+  TelemetryData data;
+
+  data.us = micros();
+  for (int c = 0; c < SENSOR_COUNT; c++) {
+    data.sensor[c] = sensors.get(c);
+  }
+  for (int axis = 0; axis < AXIS_COUNT; axis++) {
+    data.pos[axis] = motors.getPos((Axis) axis);
+  }
+  data.state         = controller.getState();
+  data.enabled       = motors.isEnabled();
+  data.paused        = job.isPaused();
+  data.made          = job.getMade();
+  data.total         = job.getTotal();
+  data.piecesPerHour = job.getPiecesPerHour();
+  telemetry.publish(data);
+}
+
 void loop() 
 {
-  static int speed = 100;
-  static int steps = 16 * 200;
-
-  if (eventQueue.messageWaiting()) {
-    Event event;
-
-    if (eventQueue.receive(event)) {
-      switch (event.pushButton) {
-      case Event::X_LEFT:  motors.stepX(-steps); break;
-      case Event::X_RIGHT: motors.stepX( steps); break;
-      case Event::Y_LEFT:  motors.stepY(-steps); break;
-      case Event::Y_RIGHT: motors.stepY( steps); break;
-      case Event::Z_LEFT:  motors.stepZ(-steps); break;
-      case Event::Z_RIGHT: motors.stepZ( steps); break;
-      case Event::ON:      motors.enable(true);  break;
-      case Event::OFF:     motors.enable(false); break;
-      case Event::STEPS:  
-        steps = event.steps * MAX_STEPS / 100; 
-        break;
-      case Event::SPEED:  
-        motors.delay(MAX_DELAY * (100.0 - event.speed) / 100.0); 
-        break;
-      case Event::START:  
-        controller.move(100);
-        controller.cut();
-        controller.eject(100);
-        break;
+  static int      speed       = 100;
+  static int      steps       = 16 * 200;
+  static uint32_t telemetryMs = 0;
+
+  Event event;
+
+  // Wakes up at once on a button, the controller is ticked at least every LOOP_PERIOD_MS
+  if (eventQueue.receive(event, pdMS_TO_TICKS(LOOP_PERIOD_MS))) {
+    switch (event.pushButton) {
+    case Event::X_LEFT:  motors.stepX(-steps); break;
+    case Event::X_RIGHT: motors.stepX( steps); break;
+    case Event::Y_LEFT:  motors.stepY(-steps); break;
+    case Event::Y_RIGHT: motors.stepY( steps); break;
+    case Event::Z_LEFT:  motors.stepZ(-steps); break;
+    case Event::Z_RIGHT: motors.stepZ( steps); break;
+    case Event::ON:      motors.enable(true);  break;
+    case Event::OFF:     
+      controller.cancel();
+      motors.enable(false); 
+      break;
+    case Event::STEPS:  
+      steps = event.steps * MAX_STEPS / 100; 
+      break;
+    case Event::SPEED:  
+      motors.delay(MAX_DELAY * (100.0 - event.speed) / 100.0); 
+      break;
+    case Event::START:  
+      if (controller.getState() == CONTROLLER_JOB) {
+        controller.pause(!controller.getJob().isPaused());
+      } else {
+        // An uploaded cut list, else the default pieces. Nothing while an upload replaces the list.
+        CutList &list = controller.getCutList();
+
+        controller.getJob().clear();
+        if (controller.getJob().setList(&list) || (list.getCount() == 0 && list.isFree() && controller.getJob().add(JOB_LENGTH, JOB_QUANTITY))) {
+          controller.startJob();
+        }
       }
+      break;
+    case Event::WIRE:
+      controller.setWire(((int64_t) event.wire << FIX16_SHIFT) / 100);
+      break;
+    case Event::LEARN:
+      controller.learn();
+      break;
     }
   }
 
-  int valueX = sensors.getX();
-  int valueY = sensors.getY();
-  int valueZ = sensors.getZ();
+  SensorEvent sensorEvent;
 
-  display.setValueX("X: " + String(valueX));
-  display.setValueY("Y: " + String(valueY));
-  display.setValueZ("Z: " + String(valueZ));
+  while (motors.getEvent(sensorEvent)) {
+    if (DEBUG_SENSOR) {
+      Serial.println((String) "Sensor " + sensorEvent.edge.channel + (sensorEvent.edge.rising ? " rising" : " falling") + 
+                     " at X " + sensorEvent.pos[AXIS_X] + ", Z " + sensorEvent.pos[AXIS_Z]);
+    }
+    controller.handleEvent(sensorEvent);
+/*
+    if (sensorEvent.edge.channel == SENSOR_CHANNEL_X && sensorEvent.edge.rising) {
+      Serial.println("In sensor");
+      testCut();
+    }
+    */
+  }
 
-  // Serial.println("Lichtschranke (X, Y, Z): " + String(valueX) + ", " + String(valueY) + ", " + String(valueZ));
+  ControllerState state = controller.getState();
 
-/*
-  if (valueX > 3000) {
-    Serial.println("In sensor");
-    testCut();
+  if (controller.tick()) {
+    if (state == CONTROLLER_JOB) {
+      printJob();
+    }
+    printFeed();
+    Serial.print(controller.getProfiler().report());
   }
-  */
 
-  delay(100);
+  if (millis() - telemetryMs >= TELEMETRY_PERIOD_MS) {
+    publishTelemetry();
+    telemetryMs = millis();
+  }
 }
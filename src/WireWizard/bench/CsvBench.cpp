@@ -0,0 +1,81 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file CsvBench.cpp
+  *
+  * Host benchmark of the cut list import: a generated 10000 line CSV goes through 
+  * CsvImport::feed in chunks of the size the web server hands over. SPIFFS is 
+  * replaced by RAM, so this measures the parser and the record handling only,
+  * from begin() to the rename in end().
+  *
+  * Build and run from this directory:
+  *   g++ -O2 -I host -I .. CsvBench.cpp ../CutList.cpp -o CsvBench && ./CsvBench
+  */
+
+#include <string>
+#include "CutList.h"
+
+#define BENCH_LINES   10000
+#define BENCH_CHUNK   1436                     //!< One TCP segment, as ESPAsyncWebServer passes the body on
+#define BENCH_RUNS    50
+
+SPIFFSFS SPIFFS;
+
+/** Lengths with and without decimals, quantities and labels of varying size. */
+static std::string makeCsv()
+{
+  std::string csv = "length,quantity,label\n";
+  char        line[64];
+
+  for (int k = 0; k < BENCH_LINES - 1; k++) {
+    snprintf(line, sizeof(line), "%d.%d,%d,\"Wire %05d\"\n", 20 + k % 980, k % 10, 1 + k % 25, k);
+    csv += line;
+  }
+  return csv;
+}
+
+int main()
+{
+  std::string csv   = makeCsv();
+  CutList     list;
+  CsvImport   import(list);
+  int         request;                         // Only its address is used, as owner of the import
+  uint32_t    bestUs = UINT32_MAX;
+
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint32_t us = micros();
+
+    if (!import.begin(&request)) {
+      printf("Import could not start\n");
+      return 1;
+    }
+    for (size_t k = 0; k < csv.size(); k += BENCH_CHUNK) {
+      import.feed(&request, (const uint8_t *) csv.data() + k, min((size_t) BENCH_CHUNK, csv.size() - k));
+    }
+    import.end(&request);
+    bestUs = min(bestUs, micros() - us);       // The import's own busy time rounds every chunk down
+  }
+  if (import.getRows() != BENCH_LINES - 1 || import.getErrors() != 0 || list.getCount() != BENCH_LINES - 1) {
+    printf("Wrong result: %u rows, %u errors, %u stored\n", import.getRows(), import.getErrors(), list.getCount());
+    return 1;
+  }
+  printf("%d lines, %u bytes in %u us (best of %d): %llu rows/s, %.1f ns/byte\n",
+         BENCH_LINES, import.getBytes(), bestUs, BENCH_RUNS,
+         bestUs > 0 ? (unsigned long long) import.getRows() * US_PER_S / bestUs : 0ULL,
+         bestUs * 1000.0 / import.getBytes());
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file PlannerBench.cpp
+  *
+  * Host benchmark of the planner: the fixed point Planner against the float 
+  * version it replaced. Both run the same moves with the limits of the feed
+  * rollers from Config.h, the benchmark prints the time per step, the duration
+  * of one move and the biggest difference between the two rate profiles.
+  *
+  * Build and run from this directory:
+  *   g++ -O2 -I host -I .. PlannerBench.cpp ../Planner.cpp -o PlannerBench && ./PlannerBench
+  */
+
+#include <math.h>
+#include "Planner.h"
+
+#define BENCH_MOVES   200
+#define BENCH_STEPS   20000
+
+/**
+  * The float planner as it was before the fixed point math, without the look-ahead helpers.
+  */
+class FloatPlanner
+{
+private:
+  float startRate;
+  float maxRate;
+  float maxAccel;
+  float jerk;
+  float rate;
+  float accel;
+  bool  decelerating;
+
+private:
+  float stopSteps(float exitRate)
+  {
+    exitRate = max(exitRate, startRate);
+
+    float v     = rate;
+    float steps = 0;
+
+    if (jerk > 0) {
+      float t = (accel + maxAccel) / jerk;
+
+      steps = v * t + accel * t * t / 2 - jerk * t * t * t / 6;
+      v     = v + accel * t - jerk * t * t / 2;
+    }
+    if (v > exitRate) {
+      steps += (v * v - exitRate * exitRate) / (2 * maxAccel);
+    }
+    return steps;
+  }
+
+public:
+  void start(const AxisLimits &l, float entryRate)
+  {
+    startRate    = l.startRate;
+    maxRate      = l.maxRate;
+    maxAccel     = l.accel;
+    jerk         = l.jerk;
+    rate         = constrain(entryRate, startRate, maxRate);
+    accel        = 0;
+    decelerating = false;
+  }
+
+  uint32_t next(long remaining, float exitRate)
+  {
+    float target = 0;
+
+    if (remaining <= stopSteps(exitRate) + 1) {
+      target       = -maxAccel;
+      decelerating = true;
+    } else if (decelerating) {
+      target = 0;
+    } else if (rate < maxRate) {
+      target = maxAccel;
+      if (jerk > 0 && maxRate - rate <= accel * accel / (2 * jerk)) {
+        target = 0;
+      }
+    }
+
+    float    dt         = 1.0f / rate;
+    uint32_t intervalUs = 1000000.0f * dt;
+
+    if (jerk > 0) {
+      float da = jerk * dt;
+
+      accel = target > accel ? min(accel + da, target) : max(accel - da, target);
+    } else {
+      accel = target;
+    }
+    rate = constrain(rate + accel * dt, startRate, maxRate);
+    return intervalUs;
+  }
+
+  float getRate()                       { return rate; }
+};
+
+static const AxisLimits limits = { 6000, 24000, 80000, 2000000 };   // AXIS_X_CONFIG
+
+/** Runs the moves, returns ns per step and the duration of one move in us. */
+template <class P> static double run(P &planner, uint64_t &moveUs)
+{
+  uint32_t start = micros();
+
+  moveUs = 0;
+  for (int m = 0; m < BENCH_MOVES; m++) {
+    uint64_t us = 0;
+
+    planner.start(limits, limits.startRate);
+    for (long remaining = BENCH_STEPS; remaining > 0; remaining--) {
+      us += planner.next(remaining, limits.startRate);
+    }
+    moveUs += us;
+  }
+  moveUs /= BENCH_MOVES;
+  return (micros() - start) * 1000.0 / ((double) BENCH_MOVES * BENCH_STEPS);
+}
+
+int main()
+{
+  Planner      fixed;
+  FloatPlanner single;
+  uint64_t     fixedUs   = 0;
+  uint64_t     floatUs   = 0;
+  float        deviation = 0;
+
+  double floatNs = run(single, floatUs);
+  double fixedNs = run(fixed,  fixedUs);
+
+  // The rate profiles over the step index, both planners side by side
+  fixed.start (limits, limits.startRate);
+  single.start(limits, limits.startRate);
+  for (long remaining = BENCH_STEPS; remaining > 0; remaining--) {
+    fixed.next (remaining, limits.startRate);
+    single.next(remaining, limits.startRate);
+    deviation = max(deviation, fabs(fixed.getRate() - single.getRate()) / single.getRate());
+  }
+
+  printf("%d moves of %d steps\n", BENCH_MOVES, BENCH_STEPS);
+  printf("float: %.1f ns/step, move %llu ms\n", floatNs, (unsigned long long) floatUs / 1000);
+  printf("fixed: %.1f ns/step, move %llu ms\n", fixedNs, (unsigned long long) fixedUs / 1000);
+  printf("rate profiles differ by %.2f%% at most\n", deviation * 100);
+  return 0;
+}
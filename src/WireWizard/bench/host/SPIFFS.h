@@ -0,0 +1,92 @@
+/*
+   Copyright (C) 2024 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/**
+  * @file SPIFFS.h
+  *
+  * SPIFFS in RAM for the host benchmarks, the files live in a map.
+  * Only what CutList uses is there.
+  */
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+
+class File
+{
+private:
+  std::vector<uint8_t> *data;
+  size_t                pos;
+
+public:
+  File(std::vector<uint8_t> *d = NULL) : data(d), pos(0) { }
+
+  operator bool() const                 { return data != NULL; }
+
+  size_t write(const uint8_t *buf, size_t len)
+  {
+    data->insert(data->end(), buf, buf + len);
+    return len;
+  }
+
+  size_t read(uint8_t *buf, size_t len)
+  {
+    len = min(len, data->size() - pos);
+    memcpy(buf, data->data() + pos, len);
+    pos += len;
+    return len;
+  }
+
+  bool seek(size_t p)                   { pos = min(p, data->size()); return pos == p; }
+  void close()                          { data = NULL; }
+};
+
+class SPIFFSFS
+{
+private:
+  std::map<std::string, std::vector<uint8_t>> files;
+
+public:
+  File open(const char *path, const char *mode)
+  {
+    if (mode[0] == 'w') {
+      files[path].clear();
+    } else if (files.find(path) == files.end()) {
+      return File();
+    }
+    return File(&files[path]);
+  }
+
+  bool remove(const char *path)         { return files.erase(path) > 0; }
+
+  bool rename(const char *from, const char *to)
+  {
+    if (files.find(from) == files.end() || files.find(to) != files.end()) {
+      return false;
+    }
+    files[to].swap(files[from]);
+    files.erase(from);
+    return true;
+  }
+};
+
+extern SPIFFSFS SPIFFS;